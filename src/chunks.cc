@@ -0,0 +1,417 @@
+#include "xtee.hh"
+
+#include <deque>
+
+extern "C"
+{
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+}
+
+#define CHUNK_POLL_MSEC (100) // the runs that have no pidfd are checked so often
+
+#ifndef MAX
+#  define MAX(X, Y) (((X)>(Y))?(X):(Y))
+#endif // MAX
+
+static int64_t nowMsec()
+{
+  struct timespec ts;
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+
+  return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+}
+
+// replaces each {} in the template with the index of the chunk
+static std::string substIndex(const char* tmpl, int idx)
+{
+  char sidx[16];
+  snprintf(sidx, sizeof(sidx), "%d", idx);
+
+  std::string result(tmpl);
+  for (size_t pos = 0; std::string::npos != (pos = result.find("{}", pos)); pos += strlen(sidx))
+    result.replace(pos, 2, sidx);
+  return result;
+}
+
+static void writeAll(int fd, const char* data, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0 && EINTR == errno)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    data += n, len -= n;
+  }
+}
+
+// -----------------------------
+// runChunks()
+// -----------------------------
+// the mode of -C, as split --filter but runs the chunks concurrently: stdin is cut into
+// chunks on the line boundaries, each chunk is fed to a fresh run of the first -c where
+// {} is replaced by the chunk index, and up to chunkJobs runs at a time. The outputs go
+// to the files of chunkOutput, or are gathered onto stdout in the order of the chunks.
+// The pipes to the runs are non-blocking, so a run that is slow to take its chunk or
+// whose output has to wait never stalls the others
+int Xtee::runChunks()
+{
+  if (_childCommands.empty())
+  {
+    errlog(LOGF_ERROR, "-C takes the command of -c to run the chunks by");
+    return -1;
+  }
+
+  if (_childCommands.size() > 1 || !_fdLinks.empty())
+    errlog(LOGF_ERROR, "-C runs the first -c only, ignoring the other -c and -l");
+
+  int jobsMax = (_options.chunkJobs > 0) ? _options.chunkJobs : MAX((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+  ::signal(SIGPIPE, SIG_IGN); // a run that quits ahead of its chunk fails the writes as EPIPE
+
+  errlog(LOGF_TRACE, "cutting stdin into chunks of %ld%s, %d run(s) at a time: %s", _options.chunkSize,
+         _options.chunkLines ? " lines" : "B", jobsMax, _childCommands[0]);
+
+  std::deque<ChunkJob> jobs; // in the order of the chunks, the head is the next to gather
+  ChunkJob *feeding = NULL;  // the run that the input goes to
+  std::vector<char> rbuf(READ_SIZE_MAX);
+  std::string input;
+  size_t inputPos = 0;
+  bool inputEOF = false;
+  int nextIdx = 0, failed = 0;
+  int64_t bytesTotal = 0, stampStart = nowMsec();
+
+  while (!_bQuit)
+  {
+    // deals the input out to the chunks as fast as the runs take it
+    while (inputPos < input.length())
+    {
+      if (NULL == feeding)
+      {
+        // the runs that exited but wait to be gathered count too, so the output held stays bounded
+        if (jobs.size() >= (size_t)jobsMax)
+          break;
+
+        jobs.push_back(ChunkJob());
+        ChunkJob &job = jobs.back();
+        job.idx = nextIdx++;
+        job.pid = job.pidfd = job.fdIn = job.fdOut = -1;
+        job.status = 0;
+        job.exited = job.outEOF = job.fedUp = false;
+        job.bytesIn = job.bytesOut = job.lines = 0;
+        if (!spawnChunk(job))
+        {
+          jobs.pop_back();
+          _bQuit = true;
+          break;
+        }
+
+        feeding = &job;
+      }
+
+      if (!feeding->feed.empty())
+        break;
+
+      bool complete = false;
+      size_t n = cutChunk(*feeding, input.data() + inputPos, input.length() - inputPos, complete);
+      feeding->feed.assign(input, inputPos, n);
+      feeding->bytesIn += n;
+      feeding->fedUp = complete;
+      inputPos += n;
+      feedChunk(*feeding);
+      if (complete)
+        feeding = NULL; // its stdin closes once the rest of the feed is written
+    }
+
+    if (inputPos >= input.length())
+      input.clear(), inputPos = 0;
+
+    if (inputEOF && input.empty() && NULL != feeding)
+    {
+      feeding->fedUp = true;
+      feedChunk(*feeding);
+      feeding = NULL;
+    }
+
+    if (_bQuit || (inputEOF && jobs.empty()))
+      break;
+
+    // pa step 1. the fds to wait for
+    std::vector<struct pollfd> fds;
+    struct pollfd pfd;
+    bool pollingPids = false;
+    if (!inputEOF && input.empty() && (NULL != feeding ? feeding->feed.empty() : jobs.size() < (size_t)jobsMax))
+    {
+      pfd.fd = STDIN_FILENO, pfd.events = POLLIN, pfd.revents = 0;
+      fds.push_back(pfd);
+    }
+
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+      ChunkJob &job = jobs[k];
+      if (job.fdIn >= 0 && !job.feed.empty())
+      {
+        pfd.fd = job.fdIn, pfd.events = POLLOUT, pfd.revents = 0;
+        fds.push_back(pfd);
+      }
+
+      // the output of a run behind the head is held up to a bound, then the run waits
+      if (job.fdOut >= 0 && (0 == k || job.out.length() < CHUNK_GATHER_MAX))
+      {
+        pfd.fd = job.fdOut, pfd.events = POLLIN, pfd.revents = 0;
+        fds.push_back(pfd);
+      }
+
+      if (!job.exited && job.pidfd >= 0)
+      {
+        pfd.fd = job.pidfd, pfd.events = POLLIN, pfd.revents = 0;
+        fds.push_back(pfd);
+      }
+
+      pollingPids = pollingPids || (!job.exited && job.pidfd < 0);
+    }
+
+    if (::poll(fds.data(), fds.size(), pollingPids ? CHUNK_POLL_MSEC : -1) < 0)
+    {
+      if (EINTR == errno)
+        continue;
+
+      errlog(LOGF_ERROR, "quitting chunks due to io err: %s(%d)", strerror(errno), errno);
+      break;
+    }
+
+    // pa step 2. the input
+    if (!fds.empty() && STDIN_FILENO == fds[0].fd && 0 != fds[0].revents)
+    {
+      ssize_t n = ::read(STDIN_FILENO, rbuf.data(), rbuf.size());
+      if (n > 0)
+      {
+        input.append(rbuf.data(), n);
+        bytesTotal += n;
+      }
+      else if (0 == n || (EINTR != errno && EAGAIN != errno))
+        inputEOF = true;
+    }
+
+    // pa step 3. the runs, all the fds are non-blocking
+    for (size_t k = 0; k < jobs.size(); k++)
+    {
+      ChunkJob &job = jobs[k];
+      feedChunk(job);
+
+      for (int r = 0; job.fdOut >= 0 && (0 == k || job.out.length() < CHUNK_GATHER_MAX) && r < LINK_PRIO_DRAIN_READS; r++)
+      {
+        ssize_t n = ::read(job.fdOut, rbuf.data(), rbuf.size());
+        if (n < 0 && (EAGAIN == errno || EINTR == errno))
+          break;
+
+        if (n <= 0)
+        {
+          ::close(job.fdOut);
+          job.fdOut = -1;
+          job.outEOF = true;
+          break;
+        }
+
+        job.bytesOut += n;
+        if (0 == k && job.out.empty())
+          writeAll(STDOUT_FILENO, rbuf.data(), n); // the head streams on
+        else
+          job.out.append(rbuf.data(), n);
+      }
+
+      if (job.exited || job.pid <= 0 || job.pid != waitpid(job.pid, &job.status, WNOHANG))
+        continue;
+
+      job.exited = true;
+      if (job.pidfd >= 0)
+        ::close(job.pidfd);
+      job.pidfd = -1;
+
+      if (!WIFEXITED(job.status) || 0 != WEXITSTATUS(job.status))
+        failed++;
+
+      errlog(LOGF_TRACE, "chunk %d pid(%d) exited w/ status(0x%x), %lldB in %lldB out", job.idx, job.pid, job.status,
+             (long long)job.bytesIn, (long long)job.bytesOut);
+    }
+
+    // pa step 4. gathers the outputs in the order of the chunks
+    while (!jobs.empty())
+    {
+      ChunkJob &head = jobs.front();
+      if (!head.out.empty())
+      {
+        writeAll(STDOUT_FILENO, head.out.data(), head.out.length());
+        head.out.clear();
+      }
+
+      if (!head.exited || head.fdOut >= 0 || head.fdIn >= 0 || &head == feeding)
+        break;
+
+      jobs.pop_front();
+    }
+  }
+
+  // the runs left by a stop take the EOF of their pipes
+  for (size_t k = 0; k < jobs.size(); k++)
+  {
+    if (jobs[k].fdIn >= 0)
+      ::close(jobs[k].fdIn);
+    if (jobs[k].fdOut >= 0)
+      ::close(jobs[k].fdOut);
+    if (jobs[k].pidfd >= 0)
+      ::close(jobs[k].pidfd);
+  }
+
+  int64_t elapsed = nowMsec() - stampStart;
+  errlog(LOGF_TRACE, "chunked %lldB into %d chunk(s) in %.3fs, %.2fMB/s, %d failed", (long long)bytesTotal, nextIdx,
+         elapsed / 1000.0, (elapsed > 0) ? (bytesTotal / 1000.0 / elapsed) : 0.0, failed);
+  return (failed > 0 || _bQuit) ? -1 : 0;
+}
+
+// spawnChunk()
+// -----------------------------
+// starts a run of the template for the chunk, whose stdout is either the file of the chunk
+// or a pipe to gather from. The pipes are close-on-exec, so no run holds those of the others
+bool Xtee::spawnChunk(ChunkJob& job)
+{
+  std::string cmd = substIndex(_childCommands[0], job.idx);
+  int pipeIn[2] = {-1, -1}, pipeOut[2] = {-1, -1}, fdFile = -1;
+  if (0 != ::pipe2(pipeIn, O_CLOEXEC))
+  {
+    errlog(LOGF_ERROR, "chunk %d failed to create pipe: %s(%d)", job.idx, strerror(errno), errno);
+    return false;
+  }
+
+  if (NULL != _options.chunkOutput)
+  {
+    std::string path = substIndex(_options.chunkOutput, job.idx);
+    if ((fdFile = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+      errlog(LOGF_ERROR, "chunk %d failed to open output[%s]: %s(%d)", job.idx, path.c_str(), strerror(errno), errno);
+  }
+  else if (0 != ::pipe2(pipeOut, O_CLOEXEC))
+    errlog(LOGF_ERROR, "chunk %d failed to create pipe: %s(%d)", job.idx, strerror(errno), errno);
+
+  pid_t pid = (fdFile >= 0 || pipeOut[1] >= 0) ? fork() : -1;
+  if (0 == pid)
+  {
+    ::dup2(pipeIn[0], STDIN_FILENO);
+    ::dup2((fdFile >= 0) ? fdFile : pipeOut[1], STDOUT_FILENO);
+    ::signal(SIGPIPE, SIG_DFL); // an ignored signal survives the exec, the run expects the default
+
+    std::vector<char> line(cmd.begin(), cmd.end());
+    line.push_back('\0');
+    char *childargv[32];
+    int childargc = lineToArgv(childargv, sizeof(childargv) / sizeof(childargv[0]) -2, line.data(), cmd.length());
+    childargv[childargc] = NULL;
+
+    int ret = execvp(childargv[0], childargv);
+    errlog(LOGF_ERROR, "chunk %d quit(%d) err[%s(%d)]: %s", job.idx, ret, strerror(errno), errno, cmd.c_str());
+    _exit(127);
+  }
+
+  ::close(pipeIn[0]);
+  if (pipeOut[1] >= 0)
+    ::close(pipeOut[1]);
+  if (fdFile >= 0)
+    ::close(fdFile);
+
+  if (pid < 0)
+  {
+    ::close(pipeIn[1]);
+    if (pipeOut[0] >= 0)
+      ::close(pipeOut[0]);
+    errlog(LOGF_ERROR, "failed to spawn chunk %d: %s", job.idx, cmd.c_str());
+    return false;
+  }
+
+  job.pid = pid;
+  job.pidfd = syscall(SYS_pidfd_open, pid, 0);
+  job.fdIn = pipeIn[1];
+  job.fdOut = pipeOut[0];
+  ::fcntl(job.fdIn, F_SETFL, ::fcntl(job.fdIn, F_GETFL) | O_NONBLOCK);
+  if (job.fdOut >= 0)
+    ::fcntl(job.fdOut, F_SETFL, ::fcntl(job.fdOut, F_GETFL) | O_NONBLOCK);
+
+  errlog(LOGF_TRACE, "chunk %d spawned pid(%d): %s", job.idx, job.pid, cmd.c_str());
+  return true;
+}
+
+// cutChunk()
+// -----------------------------
+// a chunk of bytes ends at the first line end from its size on, and a chunk of lines
+// at its last line, so that no record is split across two runs
+//@return the leading bytes of the data that belong to the chunk of the job
+size_t Xtee::cutChunk(ChunkJob& job, const char* data, size_t len, bool& complete)
+{
+  complete = false;
+  if (_options.chunkLines)
+  {
+    const char *p = data, *end = data + len, *eol = NULL;
+    while (p < end && NULL != (eol = (const char *)memchr(p, '\n', end - p)))
+    {
+      p = eol + 1;
+      if (++job.lines >= _options.chunkSize)
+      {
+        complete = true;
+        return p - data;
+      }
+    }
+
+    return len;
+  }
+
+  if (job.bytesIn + (int64_t)len < _options.chunkSize)
+    return len;
+
+  size_t from = (_options.chunkSize > job.bytesIn + 1) ? (_options.chunkSize - job.bytesIn - 1) : 0;
+  const char *eol = (const char *)memchr(data + from, '\n', len - from);
+  if (NULL == eol)
+    return len;
+
+  complete = true;
+  return eol + 1 - data;
+}
+
+// feedChunk()
+// -----------------------------
+// writes the feed to the run as much as its pipe takes, and closes its stdin once the
+// chunk is all written. A run that has quit drops the rest of its chunk
+void Xtee::feedChunk(ChunkJob& job)
+{
+  size_t written = 0;
+  while (job.fdIn >= 0 && written < job.feed.length())
+  {
+    ssize_t n = ::write(job.fdIn, job.feed.data() + written, job.feed.length() - written);
+    if (n > 0)
+    {
+      written += n;
+      continue;
+    }
+
+    if (n < 0 && (EAGAIN == errno || EINTR == errno))
+      break;
+
+    errlog(LOGF_ERROR, "chunk %d dropped its input: %s(%d)", job.idx, strerror(errno), errno);
+    ::close(job.fdIn);
+    job.fdIn = -1;
+  }
+
+  job.feed.erase(0, (job.fdIn >= 0) ? written : job.feed.length());
+  if (job.feed.empty() && job.fedUp && job.fdIn >= 0)
+  {
+    ::close(job.fdIn);
+    job.fdIn = -1;
+  }
+}
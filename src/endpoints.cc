@@ -0,0 +1,547 @@
+#include "endpoints.hh"
+
+extern "C"
+{
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+}
+
+#define RECORD_HEADER_LEN  (16 + 1 + 8 + 1) // "<seq> <checksum> "
+#define RECORD_MIN_SIZE    (32)
+#define RECORD_SEQ_PATTERNS (26)
+
+#define INPUT_READ_SIZE     (1024*1024) // bytes of a read from a regular file, aligned to the pages
+#define INPUT_READ_ALIGN    (4096)
+#define INPUT_READAHEAD     (4)         // reads to hint the kernel of ahead of the current one
+
+#ifndef MIN
+#  define MIN(X, Y) (((X)<(Y))?(X):(Y))
+#endif // MIN
+
+#ifndef MAX
+#  define MAX(X, Y) (((X)>(Y))?(X):(Y))
+#endif // MAX
+
+static int64_t nowNsec()
+{
+  struct timespec ts;
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+
+  return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+// a * b / c without the overflow of a * b, for non-negative a, and positive b and c whose
+// product fits in int64
+static int64_t mulDiv(int64_t a, int64_t b, int64_t c)
+{
+  return (a / c) * b + (a % c) * b / c;
+}
+
+// FNV-1a
+static uint32_t checksum(const char* data, size_t len)
+{
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t)data[i]) * 16777619U;
+  return hash;
+}
+
+static int64_t parseCount(const char* value)
+{
+  char *unit = NULL;
+  int64_t n = strtoll(value, &unit, 10);
+  if ('k' == *unit || 'K' == *unit)
+    n *= 1000;
+  else if ('m' == *unit || 'M' == *unit)
+    n *= 1000000;
+  return n;
+}
+
+static double mbps(int64_t bytes, int64_t nsec)
+{
+  return (nsec > 0) ? (bytes * 1000.0 / nsec) : 0;
+}
+
+// -----------------------------
+// class GenEndpoint
+// -----------------------------
+class GenEndpoint : public Xtee::Endpoint
+{
+public:
+  GenEndpoint(Xtee& xtee, int cmdNo)
+    : _xtee(xtee), _cmdNo(cmdNo), _size(100), _rate(0), _count(0), _pattern("seq"),
+      _seq(0), _offset(0), _bytes(0), _stampStart(0), _fdTimer(-1)
+  {
+  }
+
+  virtual ~GenEndpoint()
+  {
+    if (_fdTimer >= 0)
+      ::close(_fdTimer);
+  }
+
+  bool setParam(const char* name, const char* value)
+  {
+    if (0 == strcmp(name, "size"))
+      return (_size = atoi(value)) >= RECORD_MIN_SIZE;
+    if (0 == strcmp(name, "rate"))
+      return (_rate = parseCount(value)) >= 0 && _rate <= 1000000000LL; // a record per nsec at most
+    if (0 == strcmp(name, "count"))
+      return (_count = parseCount(value)) >= 0;
+    if (0 == strcmp(name, "pattern"))
+      return (0 == strcmp(value, "seq") || 0 == strcmp(value, "zero") || 0 == strcmp(value, "random")) && (_pattern = value, true);
+    return false;
+  }
+
+  bool open()
+  {
+    // the payloads of the seq and zero patterns repeat, so they are made once
+    for (int i = 0; i < RECORD_SEQ_PATTERNS && 'r' != _pattern[0]; i++)
+    {
+      std::string payload(_size - RECORD_HEADER_LEN - 1, '0');
+      for (size_t j = 0; 's' == _pattern[0] && j < payload.length(); j++)
+        payload[j] = 'a' + (i + j) % RECORD_SEQ_PATTERNS;
+
+      _payloads.push_back(payload);
+      _checksums.push_back(checksum(payload.data(), payload.length()));
+    }
+
+    // a limited rate is kept by a timer that turns readable once the next record is due
+    if (_rate > 0 && (_fdTimer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+      return false;
+
+    armTimer(0);
+    _xtee.errlog(LOGF_TRACE, "CH%02u generating records of %dB, pattern[%s] rate(%lld/s) count(%lld)", _cmdNo, _size, _pattern.c_str(), (long long)_rate, (long long)_count);
+    return true;
+  }
+
+  virtual int pollFd() { return _fdTimer; }
+
+  virtual int produce(char* buf, int size)
+  {
+    if (0 == _stampStart)
+      _stampStart = nowNsec();
+
+    if (_fdTimer >= 0)
+    {
+      uint64_t expirations = 0;
+      if (::read(_fdTimer, &expirations, sizeof(expirations)) < 0)
+        expirations = 0; // not yet due
+    }
+
+    // the records due by now, the one partly produced continues anyway
+    int64_t due = (_count > 0) ? _count : INT64_MAX;
+    if (_rate > 0)
+      due = MIN(due, mulDiv(nowNsec() - _stampStart, _rate, 1000000000LL) + 1);
+
+    int n = 0;
+    while (n < size && (_offset > 0 || _seq < due))
+    {
+      if (0 == _offset)
+        makeRecord();
+
+      int len = MIN(size - n, (int)_record.length() - _offset);
+      memcpy(buf + n, _record.data() + _offset, len);
+      n += len;
+      if ((_offset += len) >= (int)_record.length())
+        _offset = 0;
+    }
+
+    _bytes += n;
+    if (_count > 0 && _seq >= _count && 0 == _offset && 0 == n)
+    {
+      int64_t elapsed = nowNsec() - _stampStart;
+      _xtee.errlog(LOGF_TRACE, "CH%02u generated %lld records, %lldB in %.3fs, %.2fMB/s", _cmdNo, (long long)_seq, (long long)_bytes, elapsed / 1e9, mbps(_bytes, elapsed));
+      return 0; // the end
+    }
+
+    if (_rate > 0)
+      armTimer(_stampStart + mulDiv(_seq, 1000000000LL, _rate));
+
+    if (0 == n)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    return n;
+  }
+
+protected:
+  void makeRecord()
+  {
+    char header[RECORD_HEADER_LEN + 1];
+    uint32_t sum = 0;
+    std::string payload;
+    if ('r' == _pattern[0])
+    {
+      // printable bytes from the xorshift seeded by the seq, never the delimiter
+      uint64_t x = _seq * 0x9E3779B97F4A7C15ULL + 1;
+      payload.resize(_size - RECORD_HEADER_LEN - 1);
+      for (size_t j = 0; j < payload.length(); j++)
+      {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        payload[j] = '!' + x % 94;
+      }
+      sum = checksum(payload.data(), payload.length());
+    }
+    else
+      sum = _checksums[_seq % _payloads.size()];
+
+    snprintf(header, sizeof(header), "%016llx %08x ", (unsigned long long)_seq, sum);
+    _record.assign(header, RECORD_HEADER_LEN);
+    _record += ('r' == _pattern[0]) ? payload : _payloads[_seq % _payloads.size()];
+    _record += '\n';
+    _seq++;
+  }
+
+  void armTimer(int64_t stampDue)
+  {
+    if (_fdTimer < 0)
+      return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    stampDue = MAX(stampDue, 1); // zero would disarm it
+    its.it_value.tv_sec = stampDue / 1000000000LL;
+    its.it_value.tv_nsec = stampDue % 1000000000LL;
+    ::timerfd_settime(_fdTimer, TFD_TIMER_ABSTIME, &its, NULL);
+  }
+
+  Xtee& _xtee;
+  int   _cmdNo;
+  int   _size;
+  int64_t _rate, _count;
+  std::string _pattern;
+
+  std::vector<std::string> _payloads;
+  std::vector<uint32_t>    _checksums;
+  std::string _record; // the record being produced
+  int64_t _seq;
+  int     _offset;     // of the record that is partly produced
+  int64_t _bytes, _stampStart;
+  int     _fdTimer;
+};
+
+// -----------------------------
+// class VerifyEndpoint
+// -----------------------------
+class VerifyEndpoint : public Xtee::Endpoint
+{
+public:
+  VerifyEndpoint(Xtee& xtee, int cmdNo)
+    : _xtee(xtee), _cmdNo(cmdNo), _seqNext(0), _records(0), _lost(0), _disordered(0), _corrupt(0),
+      _bytes(0), _stampFirst(0), _stampLast(0)
+  {
+  }
+
+  virtual void consume(const char* data, int len)
+  {
+    _stampLast = nowNsec();
+    if (0 == _stampFirst)
+      _stampFirst = _stampLast;
+
+    _bytes += len;
+    const char *p = data, *end = data + len;
+    if (!_carry.empty())
+    {
+      const char *eol = (const char *)memchr(p, '\n', len);
+      const char *to = (NULL != eol) ? (eol + 1) : end;
+      _carry.append(p, to - p);
+      p = to;
+      if (NULL == eol)
+        return;
+
+      verify(_carry.data(), _carry.length());
+      _carry.clear();
+    }
+
+    for (const char *eol = NULL; p < end; p = eol + 1)
+    {
+      if (NULL == (eol = (const char *)memchr(p, '\n', end - p)))
+      {
+        _carry.assign(p, end - p);
+        break;
+      }
+
+      verify(p, eol + 1 - p);
+    }
+  }
+
+  virtual void onEnd()
+  {
+    if (!_carry.empty())
+      _corrupt++; // a torn record at the end
+
+    int64_t elapsed = _stampLast - _stampFirst;
+    _xtee.errlog(LOGF_TRACE, "CH%02u verified %lld records, %lldB in %.3fs, %.2fMB/s %.0frec/s; lost(%lld) disordered(%lld) corrupt(%lld)",
+                 _cmdNo, (long long)_records, (long long)_bytes, elapsed / 1e9, mbps(_bytes, elapsed),
+                 (elapsed > 0) ? (_records * 1e9 / elapsed) : 0.0, (long long)_lost, (long long)_disordered, (long long)_corrupt);
+  }
+
+protected:
+  void verify(const char* record, size_t len)
+  {
+    _records++;
+    char field[17];
+    if (len < RECORD_MIN_SIZE || ' ' != record[16] || ' ' != record[RECORD_HEADER_LEN - 1])
+    {
+      _corrupt++;
+      return;
+    }
+
+    memcpy(field, record, 16), field[16] = '\0';
+    int64_t seq = strtoll(field, NULL, 16);
+    memcpy(field, record + 17, 8), field[8] = '\0';
+    uint32_t sum = strtoul(field, NULL, 16);
+
+    if (sum != checksum(record + RECORD_HEADER_LEN, len - RECORD_HEADER_LEN - 1))
+      _corrupt++;
+
+    if (seq > _seqNext)
+      _lost += seq - _seqNext;
+    else if (seq < _seqNext)
+      _disordered++;
+
+    _seqNext = MAX(_seqNext, seq + 1);
+  }
+
+  Xtee& _xtee;
+  int   _cmdNo;
+  std::string _carry;
+  int64_t _seqNext, _records, _lost, _disordered, _corrupt;
+  int64_t _bytes, _stampFirst, _stampLast;
+};
+
+// -----------------------------
+// class InputEndpoint
+// -----------------------------
+class InputEndpoint : public Xtee::Endpoint
+{
+public:
+  InputEndpoint(Xtee& xtee, int cmdNo)
+    : _xtee(xtee), _cmdNo(cmdNo), _idx(0), _fd(-1), _isFifo(false), _offset(0),
+      _buf(NULL), _bufStart(0), _bufEnd(0), _bytes(0), _stampStart(0)
+  {
+  }
+
+  virtual ~InputEndpoint()
+  {
+    closeFile();
+    ::free(_buf);
+  }
+
+  bool open(const char* pattern)
+  {
+    glob_t g;
+    memset(&g, 0, sizeof(g));
+    if (0 == ::glob(pattern, 0, NULL, &g))
+    {
+      for (size_t i = 0; i < g.gl_pathc; i++)
+        _paths.push_back(g.gl_pathv[i]);
+    }
+    ::globfree(&g);
+
+    if (_paths.empty())
+    {
+      _xtee.errlog(LOGF_ERROR, "CH%02u no input matches: %s", _cmdNo, pattern);
+      return false;
+    }
+
+    if (0 != ::posix_memalign((void **)&_buf, INPUT_READ_ALIGN, INPUT_READ_SIZE))
+      return false;
+
+    _xtee.errlog(LOGF_TRACE, "CH%02u reading %d input file(s) in order: %s", _cmdNo, (int)_paths.size(), pattern);
+    return openFile();
+  }
+
+  // a regular file is always readable, only a FIFO is worth watching
+  virtual int pollFd() { return (_isFifo && _bufStart >= _bufEnd) ? _fd : -1; }
+
+  virtual int produce(char* buf, int size)
+  {
+    if (0 == _stampStart)
+      _stampStart = nowNsec();
+
+    while (_bufStart >= _bufEnd)
+    {
+      if (_fd < 0)
+      {
+        int64_t elapsed = nowNsec() - _stampStart;
+        _xtee.errlog(LOGF_TRACE, "CH%02u read %d input file(s), %lldB in %.3fs, %.2fMB/s", _cmdNo, (int)_paths.size(), (long long)_bytes, elapsed / 1e9, mbps(_bytes, elapsed));
+        return 0; // the end of the last file
+      }
+
+      int n = ::read(_fd, _buf, INPUT_READ_SIZE);
+      if (n < 0 && EAGAIN == errno)
+        return -1;
+
+      if (n <= 0)
+      {
+        if (n < 0)
+          _xtee.errlog(LOGF_ERROR, "CH%02u failed to read input[%s]: %s(%d)", _cmdNo, _paths[_idx].c_str(), strerror(errno), errno);
+
+        // continues with the next file of the glob
+        closeFile();
+        _idx++;
+        if (openFile() && _isFifo)
+        {
+          errno = EAGAIN;
+          return -1; // till select() finds a writer
+        }
+        continue;
+      }
+
+      _bufStart = 0, _bufEnd = n;
+      _offset += n;
+      _bytes += n;
+      readAhead();
+    }
+
+    int len = MIN(size, _bufEnd - _bufStart);
+    memcpy(buf, _buf + _bufStart, len);
+    _bufStart += len;
+    return len;
+  }
+
+protected:
+  //@return false if no more file to open
+  bool openFile()
+  {
+    for (; _idx < _paths.size(); _idx++)
+    {
+      const char *path = _paths[_idx].c_str();
+      struct stat st;
+      if (0 != ::stat(path, &st))
+      {
+        _xtee.errlog(LOGF_ERROR, "CH%02u skip input[%s]: %s(%d)", _cmdNo, path, strerror(errno), errno);
+        continue;
+      }
+
+      // a FIFO is opened without waiting for its writer, which select() then waits for
+      _isFifo = S_ISFIFO(st.st_mode);
+      if ((_fd = ::open(path, O_RDONLY | O_CLOEXEC | (_isFifo ? O_NONBLOCK : 0))) < 0)
+      {
+        _xtee.errlog(LOGF_ERROR, "CH%02u skip input[%s]: %s(%d)", _cmdNo, path, strerror(errno), errno);
+        continue;
+      }
+
+      _offset = 0;
+      if (!_isFifo)
+      {
+        ::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        readAhead();
+      }
+
+      _xtee.errlog(LOGF_TRACE, "CH%02u opened input[%s] fd(%d) %s", _cmdNo, path, _fd, _isFifo ? "fifo" : "file");
+      return true;
+    }
+
+    return false;
+  }
+
+  void closeFile()
+  {
+    if (_fd >= 0)
+      ::close(_fd);
+    _fd = -1;
+    _isFifo = false;
+  }
+
+  // has the kernel page in the reads ahead of the current one, and the head of the next file
+  // once the current one is about to end, so that the disk works while xtee forwards
+  void readAhead()
+  {
+    if (_isFifo || _fd < 0)
+      return;
+
+    ::posix_fadvise(_fd, _offset, (off_t)INPUT_READ_SIZE * INPUT_READAHEAD, POSIX_FADV_WILLNEED);
+
+    struct stat st;
+    if (_idx + 1 >= _paths.size() || 0 != ::fstat(_fd, &st) || _offset + (off_t)INPUT_READ_SIZE * INPUT_READAHEAD < st.st_size)
+      return;
+
+    int fd = ::open(_paths[_idx + 1].c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0)
+      return;
+
+    if (0 == ::fstat(fd, &st) && S_ISREG(st.st_mode))
+      ::posix_fadvise(fd, 0, (off_t)INPUT_READ_SIZE * INPUT_READAHEAD, POSIX_FADV_WILLNEED);
+    ::close(fd);
+  }
+
+  Xtee& _xtee;
+  int   _cmdNo;
+  std::vector<std::string> _paths;
+  size_t _idx;      // of the file being read
+  int    _fd;
+  bool   _isFifo;
+  off_t  _offset;   // of the file being read
+
+  char  *_buf;      // the data of the last read yet to produce
+  int    _bufStart, _bufEnd;
+  int64_t _bytes, _stampStart;
+};
+
+// -----------------------------
+// newBuiltinEndpoint()
+// -----------------------------
+Xtee::Endpoint* newBuiltinEndpoint(Xtee& xtee, int cmdNo, const char* spec)
+{
+  std::string params(spec);
+  char *saveptr = NULL, *name = strtok_r(&params[0], " ,", &saveptr);
+  if (NULL == name)
+    return NULL;
+
+  if (0 == strcmp(name, "@verify"))
+    return new VerifyEndpoint(xtee, cmdNo);
+
+  if (0 != strcmp(name, "@gen"))
+    return NULL;
+
+  GenEndpoint *gen = new GenEndpoint(xtee, cmdNo);
+  for (char *param = strtok_r(NULL, " ,", &saveptr); NULL != param; param = strtok_r(NULL, " ,", &saveptr))
+  {
+    char *value = strchr(param, '=');
+    if (NULL != value)
+      *value++ = '\0';
+
+    if (NULL == value || !gen->setParam(param, value))
+    {
+      xtee.errlog(LOGF_ERROR, "invalid param of CH%02u[%s]: %s", cmdNo, spec, param);
+      delete gen;
+      return NULL;
+    }
+  }
+
+  if (!gen->open())
+  {
+    delete gen;
+    return NULL;
+  }
+
+  return gen;
+}
+
+// -----------------------------
+// newInputEndpoint()
+// -----------------------------
+Xtee::Endpoint* newInputEndpoint(Xtee& xtee, int cmdNo, const char* pattern)
+{
+  InputEndpoint *input = new InputEndpoint(xtee, cmdNo);
+  if (!input->open(pattern))
+  {
+    delete input;
+    return NULL;
+  }
+
+  return input;
+}
@@ -0,0 +1,27 @@
+#ifndef __ENDPOINTS_HH__
+#define __ENDPOINTS_HH__
+
+#include "xtee.hh"
+
+// -----------------------------
+// the built-in endpoints
+// -----------------------------
+// given as -c "@<name> [<param>=<value>,...]" in place of a child command, which run
+// in xtee so that the overhead of xtee itself can be isolated in a benchmark:
+//   @gen     generates the records of "<seq> <checksum> <payload>\n", takes
+//              size=<bytes>      the size of a record, default 100, minimal 32
+//              rate=<n>[k|m]     records per second, default 0 as unlimited
+//              count=<n>[k|m]    records to generate, default 0 as unlimited
+//              pattern=<p>       the payload of seq|zero|random, default seq
+//   @verify  verifies the sequence numbers and the checksums of the records taken,
+//            then reports the throughput and the loss
+//@return NULL if the spec is not of a built-in endpoint
+Xtee::Endpoint* newBuiltinEndpoint(Xtee& xtee, int cmdNo, const char* spec);
+
+// the input source given as -i <path|glob>, which reads the matched files in order as if
+// they were concatenated, with large page-aligned reads and the kernel read-ahead hinted.
+// A FIFO is watched for its writer rather than blocking xtee. Multiple -i are read concurrently
+//@return NULL if nothing to read
+Xtee::Endpoint* newInputEndpoint(Xtee& xtee, int cmdNo, const char* pattern);
+
+#endif // __ENDPOINTS_HH__
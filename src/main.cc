@@ -6,8 +6,10 @@ extern "C"
 {
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
 }
 
 // -----------------------------
@@ -21,7 +23,9 @@ void usage()
             << "This is free software: you are free to change and redistribute it." EOL
             << "There is NO WARRANTY, to the extent permitted by law." EOL EOL
             << "Usage: xtee {-n|[-a] <file>} [-s <bps>] [-k <bytes>] [-t <secs>] [-d <secs>] [-q <secs>]" EOL
-            << "            [-c <cmdline>] [-l <TARGET>:<SOURCE>]" EOL EOL
+            << "            [-c <cmdline>] [-i <path|glob>] [-l <TARGET>:<SOURCE>[,<opt>...]] [-u <sockpath>] [-r]" EOL
+            << "            [-p {<cmdNo>:<cpulist>|<cmdNo>:n<node>|auto}] [-g <msec>] [-b <minKB>[:<maxKB>]]" EOL
+            << "            [-P <msec>] [-C <n>[k|m|l] [-j <jobs>] [-o <file>]]" EOL EOL
             << "Options:" EOL
             << "  -v <level>           verbose level, default 4 to output progress onto stderr" EOL
             << "  -a                   append to the output file" EOL
@@ -32,10 +36,63 @@ void usage()
             << "  -d <secs>            duration in seconds to run" EOL
             << "  -q <secs>            timeout in seconds when no more data can be read from stdin" EOL
             << "  -c <cmdline>         the child command line to execute" EOL
-            << "  -l <TARGET>:<SOURCE> links the source fd to the target fd, <TARGET> is is the sequence number of" EOL
+            << "  -c @gen [size=<bytes>,rate=<n>,count=<n>,pattern=seq|zero|random]" EOL
+            << "                       an in-process source of records \"<seq> <checksum> <payload>\\n\" instead of" EOL
+            << "                       a child, rate is of records per second, and n may end with k or m" EOL
+            << "  -c @verify           an in-process sink that verifies the records of @gen, and reports the" EOL
+            << "                       throughput and the loss" EOL
+            << "  -i <path|glob>       an in-process source of the files in place of a child such as \"cat <glob>\"," EOL
+            << "                       the matched files are read in order, and multiple -i are read concurrently." EOL
+            << "                       Its cmdNo follows the sequence of -c, and a FIFO is read once its writer opens" EOL
+            << "  -l <TARGET>:<SOURCE>[,<opt>...]" EOL
+            << "                       links the source fd to the target fd, <TARGET> is is the sequence number of" EOL
             << "                       -c options, and <SOURCE> is in format of \"<cmdNo>.<fd>\", where <cmdNo> is" EOL
             << "                       the sequence number as well, and <fd> is the output fd of that child. " EOL
-            << "                       cmdNo=0 refers to the xtee command itself" EOL
+            << "                       cmdNo=0 refers to the xtee command itself. A link between two children where" EOL
+            << "                       neither party has another link is wired directly, without xtee in between." EOL
+            << "                       The options of a link are:" EOL
+            << "                         relay  keeps xtee in the data path, implied by any other option" EOL
+            << "                         rec    forwards complete lines only, so that the lines from multiple" EOL
+            << "                                sources to a target never interleave, the sources take turns by" EOL
+            << "                                deficit round-robin" EOL
+            << "                         w=<n>  the reads that the source takes a round, n times those of a w=1" EOL
+            << "                                source, which weighs its share of a busy target, implies rec, default 1" EOL
+            << "                         prio=<p> the priority class of high|normal|bulk, default normal. When" EOL
+            << "                                xtee is saturated, the ready sources of a higher class are read and" EOL
+            << "                                written first, and a high one is drained at a time" EOL
+            << "                         sample=<n>|<p>%|<t>ms  forwards only every nth line, a random p% of" EOL
+            << "                                the lines, or a line per t msec, such as to a monitoring child" EOL
+            << "                         grep=<substr> forwards only the lines containing the substring" EOL
+            << "                         re=<regex> forwards only the lines matching the POSIX extended regex." EOL
+            << "                                Neither may contain a comma, and sample counts the matched lines" EOL
+            << "                         xf=<path.so>[:<arg>] transforms the data by the plugin ahead of grep, re" EOL
+            << "                                and sample, see xtee_plugin.h for the interface" EOL
+            << "                         coalesce=<bytes>[/<msec>] holds the small writes of the source and writes" EOL
+            << "                                them at once when so many bytes or the oldest held msec reached," EOL
+            << "                                default 2 msec, such as for a chatty logger. A rec link has its own" EOL
+            << "                                queue, so it is not coalesced" EOL
+            << "  -b <minKB>[:<maxKB>] the bounds that the capacity of the pipes to the children adapts within by" EOL
+            << "                       their throughput, default 64KB up to /proc/sys/fs/pipe-max-size. A low min" EOL
+            << "                       such as 4 saves the memory of many idle children" EOL
+            << "  -P <msec>            profiles the children every interval, logs a timeline per child of its cpu," EOL
+            << "                       rss, read/write and disk rates, context switches, and the throughput of its" EOL
+            << "                       links, such as to tell a CPU-bound stage from an I/O-bound one. Only the" EOL
+            << "                       process of the child counts, not those it forks such as by sh -c" EOL
+            << "  -C <n>[k|m|l]        cuts stdin into chunks of n bytes, or of n lines if it ends with l, and runs" EOL
+            << "                       the first -c over each chunk in a fresh process where {} in the command" EOL
+            << "                       is replaced by the chunk index, such as split --filter. A chunk of bytes" EOL
+            << "                       ends at the first line end from its size on, so no line is split" EOL
+            << "  -j <jobs>            the chunks of -C that run concurrently, default the number of cpus" EOL
+            << "  -o <file>            the output file of each chunk of -C with {} for the index, the outputs" EOL
+            << "                       are otherwise gathered onto stdout in the order of the chunks" EOL
+            << "  -g <msec>            the longest a ready source waits behind the higher priorities, default 100" EOL
+            << "  -p <cmdNo>:<cpulist> places the command onto the given cpus, such as 0-3,8, cmdNo=0 refers to xtee" EOL
+            << "  -p <cmdNo>:n<node>   places the command onto the cpus and memory of the given NUMA node" EOL
+            << "  -p auto              places each chain of producer->xtee->consumer onto a same NUMA node" EOL
+            << "  -r                   the children's stdout to xtee stdout by default fan in by lines as rec" EOL
+            << "  -u <sockpath>        listens on the unix-domain socket for taps, a tap connects and sends a line of" EOL
+            << "                       \"<SOURCE> [lossy|lossless]\" then receives a copy of that source from then on." EOL
+            << "                       A tap is lossy by default, which drops the data it can not take instantly" EOL
             << "  -h                   display this screen" EOL EOL
             << "Examples:" EOL
             << "  a) the following command results the same as runing \"ls -l | sort\" and \"ls -l | grep txt\"，but the" EOL
@@ -48,6 +105,15 @@ void usage()
             << "       xtee -c 'wget -O - http://…' -c 'zip - -o file.zip' -l 0:1.1 -l 2.0:1 -n -s 3750" EOL
             << "       wget -O - http://… | xtee -c 'zip - -o file.zip' -l 1.0:0.1 -n -s 3750" EOL
             << "       wget -O - http://… | xtee -n -s 3750000 | zip - -o file.zip" EOL
+            << "  d) the following commands tap the output of \"ls -l\" in a running xtee:" EOL
+            << "       xtee -c \"ls -lR /\" -c sort -l 2:1.1 -u /tmp/xtee.sock" EOL
+            << "       echo 1.1 | nc -U /tmp/xtee.sock" EOL
+            << "  e) the following command measures xtee itself relaying 1M records of 1KB by a line filter:" EOL
+            << "       xtee -n -c '@gen size=1024,count=1m' -c @verify -l '2:1.1,grep=0'" EOL
+            << "  f) the following command feeds the rotated logs in order and a FIFO side by side to a filter:" EOL
+            << "       xtee -n -i '/var/log/app.log.*' -i /tmp/app.fifo -c 'grep ERROR' -l 3:1.1 -l 3:2.1" EOL
+            << "  g) the following command compresses a big log by chunks of 1M lines on 8 cores, to part.0.gz ...:" EOL
+            << "       xtee -n -C 1000000l -j 8 -c 'gzip -c' -o 'part.{}.gz' < app.log" EOL
             << EOL;
 }
 
@@ -70,7 +136,8 @@ int main(int argc, char *argv[])
   ::signal(SIGINT, OnSingal); 
 
   int opt = 0;
-  while (-1 != (opt = getopt(argc, argv, "hnas:k:t:d:q:c:l:")))
+  const char *chunkOpt = NULL; // an option that applies to -C only
+  while (-1 != (opt = getopt(argc, argv, "hnras:k:t:d:q:c:i:l:u:p:g:b:P:C:j:o:")))
   {
     switch (opt)
     {
@@ -82,6 +149,10 @@ int main(int argc, char *argv[])
       xtee._options.append = true;
       break;
 
+    case 'r':
+      xtee._options.recordFanIn = true;
+      break;
+
     case 's':
       xtee._options.kbps = atol(optarg);
       break;
@@ -103,13 +174,77 @@ int main(int argc, char *argv[])
       break;
 
     case 'c':
-      xtee.pushCommand(optarg);
+      if (xtee.pushCommand(optarg) < 0)
+        return -1;
+      break;
+
+    case 'i':
+      if (xtee.pushInput(optarg) < 0)
+        return -1;
       break;
 
     case 'l':
       xtee.pushLink(optarg);
       break;
 
+    case 'u':
+      xtee._options.tapSocket = optarg;
+      break;
+
+    case 'g':
+      xtee._options.msecAging = atoi(optarg);
+      break;
+
+    case 'b':
+      {
+        const char *max = strchr(optarg, ':');
+        xtee._options.pipeMin = atol(optarg) << 10;
+        xtee._options.pipeMax = (NULL != max) ? (atol(max + 1) << 10) : 0;
+      }
+      break;
+
+    case 'P':
+      xtee._options.msecProfile = atoi(optarg);
+      break;
+
+    case 'C':
+      {
+        char *unit = NULL;
+        long size = strtol(optarg, &unit, 10);
+        int shift = 0;
+        if ('k' == *unit || 'K' == *unit)
+          shift = 10, unit++;
+        else if ('m' == *unit || 'M' == *unit)
+          shift = 20, unit++;
+        else if ('l' == *unit)
+          xtee._options.chunkLines = true, unit++;
+
+        if (size <= 0 || size > (LONG_MAX >> shift) || '\0' != *unit)
+        {
+          xtee.errlog(LOGF_ERROR, "invalid chunk size: %s", optarg);
+          return -1;
+        }
+        xtee._options.chunkSize = size << shift;
+      }
+      break;
+
+    case 'j':
+      xtee._options.chunkJobs = atoi(optarg);
+      chunkOpt = "-j";
+      break;
+
+    case 'o':
+      xtee._options.chunkOutput = optarg;
+      chunkOpt = "-o";
+      break;
+
+    case 'p':
+      if (0 == strcmp(optarg, "auto"))
+        xtee._options.autoPlace = true;
+      else
+        xtee.pushPlacement(optarg);
+      break;
+
     default:
       ret = -1;
     case 'h':
@@ -119,6 +254,12 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (NULL != chunkOpt && xtee._options.chunkSize <= 0)
+  {
+    xtee.errlog(LOGF_ERROR, "%s takes -C to cut the input into chunks", chunkOpt);
+    return -1;
+  }
+
   return xtee.init() ? xtee.run() :-100;
 }
 
@@ -1,4 +1,5 @@
 #include "xtee.hh"
+#include "endpoints.hh"
 
 extern "C"
 {
@@ -10,12 +11,31 @@ extern "C"
 #include <fcntl.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <ctype.h>
 }
 
 #define QoS_MEASURE_INTERVAL_MSEC (1000/QoS_MEASURES_PER_SEC) // msec
+#define CHILD_POLL_INTERVAL_MSEC  (1000) // for the children that have no pidfd to watch
+#define ENDPOINT_IDLE_MSEC        (10)   // for the source endpoints that have no pollFd and had no data
 
 #define LOG_LINE_MAX_BUF (256)
+#define TAP_REQUEST_MAX  (64)
+#define TAP_BACKLOG      (8)
+
+#define SYSFS_NODE_DIR   "/sys/devices/system/node"
+#define MPOL_PREFERRED_  (1) // MPOL_PREFERRED of <numaif.h>, without taking libnuma
 
 #define PSTDIN(_PIO) (_PIO[0])
 #define PSTDOUT(_PIO) (_PIO[1])
@@ -38,21 +58,27 @@ extern "C"
 #  define MIN(X, Y) (((X)<(Y))?(X):(Y))
 #endif // MIN
 
+#ifndef MAX
+#  define MAX(X, Y) (((X)>(Y))?(X):(Y))
+#endif // MAX
+
+// the stamps are in msec of CLOCK_MONOTONIC, the same clock that the timerfd takes
 static int64_t now()
 {
-  struct timeval tmval;
-  if (0 != gettimeofday(&tmval, (struct timezone *)NULL))
+  struct timespec ts;
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
     return 0;
 
-  return (tmval.tv_sec * 1000LL + tmval.tv_usec / 1000);
+  return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
 }
 
 // -----------------------------
 // class Xtee
 // -----------------------------
 Xtee::Xtee()
-    : _stampStart(0), _stampLast(0), _offsetOrigin(0), _offsetLast(0), 
+    : _fdTapListener(-1), _relayBuf(NULL), _routeGen(0), _routesDirty(true), _stampAdapted(0), _stampStart(0), _stampLast(0), _offsetOrigin(0), _offsetLast(0), 
     _kBpsLimit(0), _lastv(0), _childsToStdin(0),
+    _stampArmed(0), _stampActivity(0), _stampStdinResume(0), _fdTimer(-1), _stampProfileStart(0),
     _options({.noOutFile = false,
                 .append = false,
                 .kbps = -1,
@@ -60,6 +86,18 @@ Xtee::Xtee()
                 .secsToSkip = -1,
                 .secsDuration = -1,
                 .secsTimeout = -1,
+                .tapSocket = NULL,
+                .recordFanIn = false,
+                .autoPlace = false,
+                .msecAging = 100,
+                .noStdin = false,
+                .pipeMin = PIPE_SIZE_MIN_DEFAULT,
+                .pipeMax = 0,
+                .msecProfile = 0,
+                .chunkSize = 0,
+                .chunkLines = false,
+                .chunkJobs = 0,
+                .chunkOutput = NULL,
                 .logflags = 0xff})
 {
 }
@@ -89,17 +127,128 @@ bool Xtee::init()
   if (_options.kbps >0)
     _kBpsLimit = _options.kbps >>3;
 
+  if (_options.noStdin)
+    _bStdinEOF = true;
+
+  // the pipes grow no larger than an unprivileged process may have
+  long pipeMaxSys = 0;
+  FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+  if (NULL != fp)
+  {
+    if (1 != fscanf(fp, "%ld", &pipeMaxSys))
+      pipeMaxSys = 0;
+    fclose(fp);
+  }
+
+  if (pipeMaxSys > 0 && (_options.pipeMax <= 0 || _options.pipeMax > pipeMaxSys))
+    _options.pipeMax = pipeMaxSys;
+  _options.pipeMin = MAX(_options.pipeMin, sysconf(_SC_PAGESIZE));
+  _options.pipeMax = MAX(_options.pipeMax, _options.pipeMin);
+  errlog(LOGF_TRACE, "pipes adapt within %ldKB-%ldKB, reads within %dKB-%dKB", _options.pipeMin >> 10, _options.pipeMax >> 10, READ_SIZE_MIN >> 10, READ_SIZE_MAX >> 10);
+
+  memset(_deadlines, 0, sizeof(_deadlines));
+  _fdTimer = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (_fdTimer < 0)
+  {
+    errlog(LOGF_ERROR, "failed to create timerfd: %s(%d)", strerror(errno), errno);
+    return false;
+  }
+
+  if (NULL != _options.tapSocket)
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(_options.tapSocket) >= sizeof(addr.sun_path))
+    {
+      errlog(LOGF_ERROR, "tap socket path too long: %s", _options.tapSocket);
+      return false;
+    }
+
+    strcpy(addr.sun_path, _options.tapSocket);
+
+    // a stale socket left by a previous run is removed, but never any other kind of file
+    struct stat st;
+    if (0 == ::lstat(_options.tapSocket, &st))
+    {
+      if (!S_ISSOCK(st.st_mode))
+      {
+        errlog(LOGF_ERROR, "tap socket path[%s] exists and is not a socket", _options.tapSocket);
+        return false;
+      }
+
+      ::unlink(_options.tapSocket);
+    }
+
+    _fdTapListener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_fdTapListener < 0 || ::bind(_fdTapListener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(_fdTapListener, TAP_BACKLOG) < 0)
+    {
+      errlog(LOGF_ERROR, "failed to listen on tap socket[%s]: %s(%d)", _options.tapSocket, strerror(errno), errno);
+      return false;
+    }
+
+    memset(&_statTapSocket, 0, sizeof(_statTapSocket));
+    ::lstat(_options.tapSocket, &_statTapSocket);
+    errlog(LOGF_TRACE, "listening on tap socket[%s] fd(%d)", _options.tapSocket, _fdTapListener);
+  }
+
   return true;
 }
 
+Xtee::~Xtee()
+{
+  for (size_t i = 0; i < _builtins.size(); i++)
+    delete _builtins[i];
+
+  if (NULL != _relayBuf)
+    ::munmap(_relayBuf, READ_SIZE_MAX);
+}
+
 int Xtee::pushCommand(char *cmd)
 {
+  if (cmd && '@' == cmd[0])
+  {
+    // a built-in endpoint instead of a command to spawn
+    Endpoint *endpoint = newBuiltinEndpoint(*this, _childCommands.size() + 1, cmd);
+    if (NULL == endpoint)
+    {
+      errlog(LOGF_ERROR, "invalid built-in endpoint: %s", cmd);
+      return -1;
+    }
+
+    _builtins.push_back(endpoint);
+    return pushEndpoint(endpoint, cmd);
+  }
+
   if (cmd && strlen(cmd) > 0)
     _childCommands.push_back(cmd);
 
   return _childCommands.size();
 }
 
+int Xtee::pushInput(const char* pattern)
+{
+  Endpoint *endpoint = newInputEndpoint(*this, _childCommands.size() + 1, pattern);
+  if (NULL == endpoint)
+  {
+    errlog(LOGF_ERROR, "invalid input: %s", pattern);
+    return -1;
+  }
+
+  _builtins.push_back(endpoint);
+  return pushEndpoint(endpoint, pattern);
+}
+
+int Xtee::pushEndpoint(Endpoint* endpoint, const char* name)
+{
+  if (NULL == endpoint)
+    return -1;
+
+  _childCommands.push_back(const_cast<char *>(name));
+  _endpoints[_childCommands.size()] = endpoint;
+  return _childCommands.size();
+}
+
 int Xtee::pushLink(char *link)
 {
   if (link && strlen(link) > 0)
@@ -108,16 +257,310 @@ int Xtee::pushLink(char *link)
   return _fdLinks.size();
 }
 
-static char buf[1024*4] = {0};
+int Xtee::pushPlacement(char *placement)
+{
+  if (placement && strlen(placement) > 0)
+    _placementSpecs.push_back(placement);
+
+  return _placementSpecs.size();
+}
+
+// -----------------------------
+// CPU and NUMA placement
+// -----------------------------
+// parses a cpu list in the format of "0-3,8,10-11" as the kernel prints in sysfs
+static bool parseCpuList(const char* list, cpu_set_t& cpus)
+{
+  CPU_ZERO(&cpus);
+  for (const char *p = list; *p && !isspace(*p);)
+  {
+    char *end = NULL;
+    long from = strtol(p, &end, 10), to = from;
+    if (end == p)
+      return false;
+
+    if ('-' == *end)
+    {
+      p = end + 1;
+      to = strtol(p, &end, 10);
+      if (end == p)
+        return false;
+    }
+
+    for (long c = from; c <= to && c < CPU_SETSIZE; c++)
+      CPU_SET(c, &cpus);
+
+    p = (',' == *end) ? end + 1 : end;
+  }
+
+  return CPU_COUNT(&cpus) > 0;
+}
+
+static bool nodeCpus(int node, cpu_set_t& cpus)
+{
+  char path[64], list[1024] = "";
+  snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (NULL == f)
+    return false;
+
+  bool ret = (NULL != fgets(list, sizeof(list), f)) && parseCpuList(list, cpus);
+  fclose(f);
+  return ret;
+}
+
+static int nodeCount()
+{
+  int count = 0;
+  char path[64];
+  for (;; count++)
+  {
+    snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d", count);
+    if (0 != ::access(path, F_OK))
+      break;
+  }
+
+  return count;
+}
+
+//@return the node that all of the cpus belong to, -1 if they are across nodes
+static int nodeOfCpus(const cpu_set_t& cpus)
+{
+  for (int node = 0, count = nodeCount(); node < count; node++)
+  {
+    cpu_set_t nodeSet, common;
+    if (!nodeCpus(node, nodeSet))
+      continue;
+
+    CPU_AND(&common, &nodeSet, &cpus);
+    if (CPU_EQUAL(&common, &cpus))
+      return node;
+  }
+
+  return -1;
+}
+
+static std::string cpus2str(const cpu_set_t& cpus)
+{
+  std::string str;
+  char tmp[32];
+  for (int c = 0; c < CPU_SETSIZE; c++)
+  {
+    if (!CPU_ISSET(c, &cpus))
+      continue;
+
+    int to = c;
+    while (to + 1 < CPU_SETSIZE && CPU_ISSET(to + 1, &cpus))
+      to++;
+
+    snprintf(tmp, sizeof(tmp), (to > c) ? "%d-%d," : "%d,", c, to);
+    str += tmp;
+    c = to;
+  }
+
+  if (!str.empty())
+    str.erase(str.length() - 1);
+  return str;
+}
+
+static int findRoot(std::vector<int>& parents, int i)
+{
+  while (parents[i] != i)
+    i = parents[i] = parents[parents[i]];
+  return i;
+}
+
+// planPlacements()
+// -----------------------------
+// resolves the -p options of "<cmdNo>:<cpulist>" and "<cmdNo>:n<node>", then if
+// auto placement is on, places the parties that -p doesn't cover: the children
+// that exchange data thru xtee go to the node of xtee, and each group of children
+// wired only among themselves goes to the next node by turns
+void Xtee::planPlacements()
+{
+  for (size_t i = 0; i < _placementSpecs.size(); i++)
+  {
+    char *spec = _placementSpecs[i], *where = strchr(spec, ':');
+    int cmdNo = atoi(spec);
+    Placement placement;
+    placement.node = -1;
+
+    bool valid = (NULL != where && cmdNo >= 0 && cmdNo <= (int)_childCommands.size());
+    if (valid && 'n' == where[1])
+      valid = nodeCpus(placement.node = atoi(where + 2), placement.cpus);
+    else if (valid)
+    {
+      valid = parseCpuList(where + 1, placement.cpus);
+      placement.node = nodeOfCpus(placement.cpus);
+    }
+
+    if (!valid)
+    {
+      errlog(LOGF_ERROR, "skip invalid placement: %s", spec);
+      continue;
+    }
+
+    _placements[cmdNo] = placement;
+  }
+
+  int nodes = nodeCount();
+  if (!_options.autoPlace || nodes <= 0)
+    return;
+
+  // group the parties by the links, xtee joins a group if it is in the data path
+  size_t nParties = _childCommands.size() + 1;
+  std::vector<int> parents(nParties);
+  std::vector<bool> outLinked(nParties, false);
+  for (size_t i = 0; i < nParties; i++)
+    parents[i] = i;
+
+  for (size_t i = 0; i < _links.size(); i++)
+  {
+    LinkSpec &spec = _links[i];
+    if (STDOUT_FILENO == spec.childFdSrc)
+      outLinked[spec.childIdSrc] = true;
+
+    parents[findRoot(parents, spec.childIdSrc)] = findRoot(parents, spec.childIdDest);
+    if (spec.wire[0] < 0)
+      parents[findRoot(parents, spec.childIdSrc)] = findRoot(parents, 0);
+  }
+
+  for (size_t i = 1; i < nParties; i++)
+  {
+    if (!outLinked[i]) // the orphan stdout goes to xtee stdout
+      parents[findRoot(parents, i)] = findRoot(parents, 0);
+  }
+
+  int nodeXtee = 0;
+  if (_placements.end() != _placements.find(0) && _placements[0].node >= 0)
+    nodeXtee = _placements[0].node;
+  else
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    nodeXtee = MAX(nodeOfCpus(cpus), 0);
+  }
+
+  std::map<int, int> groupNodes;
+  groupNodes[findRoot(parents, 0)] = nodeXtee;
+  int nextNode = nodeXtee;
+  for (size_t i = 0; i < nParties; i++)
+  {
+    int group = findRoot(parents, i);
+    if (groupNodes.end() == groupNodes.find(group))
+      groupNodes[group] = (nextNode = (nextNode + 1) % nodes);
+
+    if (_placements.end() != _placements.find(i))
+      continue; // -p takes the precedence
+
+    Placement placement;
+    placement.node = groupNodes[group];
+    if (nodeCpus(placement.node, placement.cpus))
+      _placements[i] = placement;
+  }
+}
+
+// applyPlacement()
+// -----------------------------
+// binds the calling process to the cpus of the placement, and prefers its node for
+// the memory to allocate. The preference survives exec, so a child takes it along
+bool Xtee::applyPlacement(int cmdNo)
+{
+  Placements::iterator it = _placements.find(cmdNo);
+  if (_placements.end() == it)
+    return true;
+
+  Placement &placement = it->second;
+  if (0 != sched_setaffinity(0, sizeof(placement.cpus), &placement.cpus))
+  {
+    errlog(LOGF_ERROR, "failed to place CH%02d on cpus[%s]: %s(%d)", cmdNo, cpus2str(placement.cpus).c_str(), strerror(errno), errno);
+    return false;
+  }
+
+  if (placement.node >= 0 && placement.node < (int)(sizeof(unsigned long) * 8))
+  {
+    unsigned long nodemask = 1UL << placement.node;
+    if (0 != syscall(SYS_set_mempolicy, MPOL_PREFERRED_, &nodemask, sizeof(nodemask) * 8))
+      errlog(LOGF_ERROR, "failed to prefer node(%d) for CH%02d: %s(%d)", placement.node, cmdNo, strerror(errno), errno);
+  }
+
+  errlog(LOGF_TRACE, "placed CH%02d on cpus[%s] node(%d)", cmdNo, cpus2str(placement.cpus).c_str(), placement.node);
+  return true;
+}
+
+// findSubstr()
+// -----------------------------
+// the substring search of the grep filters, which takes AVX2 if the cpu has it
+typedef const char* (*SubstrFinder)(const char* hay, size_t n, const char* needle, size_t k);
+
+static const char* findSubstrStd(const char* hay, size_t n, const char* needle, size_t k)
+{
+  return (const char *)memmem(hay, n, needle, k);
+}
+
+#if defined(__x86_64__)
+// compares the first and the last byte of the needle against 32 positions at a time,
+// only the positions where both match are verified by memcmp
+__attribute__((target("avx2")))
+static const char* findSubstrAvx2(const char* hay, size_t n, const char* needle, size_t k)
+{
+  if (k <= 1 || n < k)
+    return (k > 1) ? NULL : (k ? (const char *)memchr(hay, needle[0], n) : hay);
+
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last  = _mm256_set1_epi8(needle[k - 1]);
+  size_t i = 0;
+  for (; i + k - 1 + 32 <= n; i += 32)
+  {
+    __m256i blockFirst = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i blockLast  = _mm256_loadu_si256((const __m256i *)(hay + i + k - 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst), _mm256_cmpeq_epi8(last, blockLast)));
+    for (; 0 != mask; mask &= mask - 1)
+    {
+      size_t pos = i + __builtin_ctz(mask);
+      if (0 == memcmp(hay + pos + 1, needle + 1, k - 2))
+        return hay + pos;
+    }
+  }
+
+  return findSubstrStd(hay + i, n - i, needle, k);
+}
+#endif // __x86_64__
+
+static SubstrFinder resolveSubstrFinder()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return findSubstrAvx2;
+#endif // __x86_64__
+  return findSubstrStd;
+}
+
+static const SubstrFinder findSubstr = resolveSubstrFinder();
+
 //@return bytes read from the fd, -1 if error occured at reading
 int Xtee::checkAndForward(int &fd, int defaultfd, int childIdx)
 {
-  int n = 0;
+  int n = 0, total = 0;
+  if (fd < 0)
+    return 0; // the source has been closed, or an endpoint has no such side
 
-  if (IS_VALID_FLAG_SET(fd, _fdsetRead) && (n = ::read(fd, buf, sizeof(buf))) > 0)
+  RouteView route;
+  routeOf(fd, route);
+
+  // a source that fans in records by a DRR weight gets as many reads per round
+  FlowStub &flow = flowOf(fd);
+  for (int r = 0; r < route.reads && IS_VALID_FLAG_SET(fd, _fdsetRead) && (n = readFrom(fd, _relayBuf, flow.readSize)) > 0; r++)
   {
-    FDIndex::iterator itIdx = _fd2fwd.find(fd);
-    // if (_fd2fwd.end() == itIdx) // if (fwdset.empty())
+    total += n;
+
+    // a full read hints more to come, the read grows at once rather than by the next period
+    if (n >= flow.readSize && flow.readSize < READ_SIZE_MAX)
+      flow.readSize <<= 1;
+
+    // if (0 == route.ndests) // if (fwdset.empty())
     // {
     //   if (defaultfd == STDERR_FILENO && childIdx > 0)
     //   {
@@ -133,37 +576,23 @@ int Xtee::checkAndForward(int &fd, int defaultfd, int childIdx)
     // }
     // else
     // {
-    if (_fd2fwd.end() != itIdx)
-    {
-      FDSet& fwdset =itIdx->second;
-      for (FDSet::const_iterator it = fwdset.begin(); it != fwdset.end(); it++)
-      {
-        if (*it < 0)
-          continue;
-
-        if (*it == STDIN_FILENO)
-        {
-          stdinQoS(buf, n);
-          continue;
-        }
-
-        if (*it == STDERR_FILENO && childIdx > 0)
-        {
-          errlog(LOGF_TRACE, "CH%02u> %s", (unsigned)childIdx, std::string(buf, n).c_str());
-          continue;
-          // char cIdent[20];
-          // snprintf(cIdent, sizeof(cIdent) - 2, "CH%02u> ", (unsigned)childIdx);
-          // ::write(defaultfd, cIdent, strlen(cIdent));
-        }
+    forwardChunk(route, _relayBuf, n, childIdx);
+  }
 
-          ::write(*it, buf, n);
-      }
-    }
+  // a source at EOF stays readable, close it rather than letting it look busy to select()
+  bool eof = (0 == n && IS_VALID_FLAG_SET(fd, _fdsetRead));
+  if (total > 0)
+  {
+    n = total; // the EAGAIN of a non-blocking source ends its reads of the round
+    flowOf(fd).bytes += total;
+    flowOf(fd).total += total;
+    if (_deadlines[TIMER_ADAPT] <= 0)
+      setTimer(TIMER_ADAPT, now() + PIPE_ADAPT_MSEC);
   }
 
-  if (fd > STDERR_FILENO && IS_VALID_FLAG_SET(fd, _fdsetErr))
+  if (fd > STDERR_FILENO && (eof || IS_VALID_FLAG_SET(fd, _fdsetErr)))
   {
-    errlog(LOGF_TRACE, "closing damaged-fd(%d) to CH%02u", fd, childIdx);
+    errlog(LOGF_TRACE, "closing %s-fd(%d) to CH%02u", eof ? "eof" : "damaged", fd, childIdx);
     closeSrcFd(fd);
     n = -1;
   }
@@ -171,72 +600,569 @@ int Xtee::checkAndForward(int &fd, int defaultfd, int childIdx)
   return n;
 }
 
-// stdinQoS()
+// forwardChunk()
 // -----------------------------
-int Xtee::stdinQoS(const char* buf, int n)
+void Xtee::forwardChunk(const RouteView& route, const char* buf, int len, int childIdx)
 {
-  if (n <=0)
-    return 0;
+  for (int i = 0; i < route.ndests; i++)
+  {
+    if (NULL != route.hops && queueToHop(route.hops[i], buf, len))
+      continue;
 
-  int64_t stampNow = now();
+    emitToDest(route.dests[i], buf, len, childIdx);
+  }
+}
 
-  // yield if stamp start is defined and not meet
-  if (_stampStart >0 && _stampStart > stampNow)
-    return n;
+// drainSrcFd()
+// -----------------------------
+// forwards what is left in the pipe of a child that has exited, without blocking
+// in case that the pipe is still held by its descendants. An endpoint has no pipe
+// to be left in
+void Xtee::drainSrcFd(int fd, int childIdx)
+{
+  if (fd <= STDERR_FILENO || NULL != endpointOf(fd))
+    return;
 
-  if (_stampStart<=0)
-    _stampStart = stampNow;
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-  if (_options.secsDuration >0 && stampNow >(_stampStart + _options.secsDuration *1000))
-    _bQuit = true;
+  RouteView route;
+  routeOf(fd, route);
+  int n = 0;
+  while ((n = ::read(fd, _relayBuf, READ_SIZE_MAX)) > 0)
+    forwardChunk(route, _relayBuf, n, childIdx);
+}
 
-  const char * p = buf;
-  
-  // yield if the leading yield bytes is specified
-  if (_options.bytesToSkip >0)
+// emitToDest()
+// -----------------------------
+void Xtee::emitToDest(int fdDest, const char* buf, int len, int childIdx)
+{
+  if (fdDest == STDIN_FILENO)
   {
-    if ((_offsetOrigin +n) <= _options.bytesToSkip)
-      return n;
-  
-    if (_offsetOrigin <_options.bytesToSkip)
-    {
-      uint bytesToSkip = _options.bytesToSkip - _offsetOrigin;
-      p += bytesToSkip;
-      n -= bytesToSkip;
-    }
+    stdinQoS(buf, len);
+    return;
   }
 
-  _offsetOrigin += n;
+  if (fdDest == STDERR_FILENO && childIdx > 0)
+  {
+    errlog(LOGF_TRACE, "CH%02u> %s", (unsigned)childIdx, std::string(buf, len).c_str());
+    return;
+    // char cIdent[20];
+    // snprintf(cIdent, sizeof(cIdent) - 2, "CH%02u> ", (unsigned)childIdx);
+    // ::write(defaultfd, cIdent, strlen(cIdent));
+  }
 
-  // forward the data
-  FDIndex::iterator itIdx = _fd2fwd.find(STDIN_FILENO);
-  if (_fd2fwd.end() == itIdx) // if (fwdset.empty())
-    ::write(STDOUT_FILENO, p, n);
+  forwardTo(fdDest, buf, len);
+}
+
+// queueToHop()
+// -----------------------------
+//@return true if the hop has taken the data, either into its queue or passed on by itself,
+//        instead of being forwarded instantly
+bool Xtee::queueToHop(HopStub* hop, const char* buf, int len)
+{
+  if (NULL == hop)
+    return false;
+
+  if (NULL != hop->opts.xf)
+    transformChunk(*hop, buf, len);
+  else if (selectsLines(hop->opts))
+    selectLines(*hop, buf, len);
+  else if (hop->opts.records || hop->opts.coalesceBytes > 0)
+    passToHop(*hop, buf, len);
+  else
+    return false;
+
+  return true;
+}
+
+// stageHop()
+// -----------------------------
+// the stages after the transform: selects the lines if the hop filters or samples,
+// then passes them on
+void Xtee::stageHop(HopStub& hop, const char* buf, int len)
+{
+  if (selectsLines(hop.opts))
+    selectLines(hop, buf, len);
+  else
+    passToHop(hop, buf, len);
+}
+
+static void appendOutput(void *ctx, const char *data, size_t len)
+{
+  ((std::string *)ctx)->append(data, len);
+}
+
+// transformChunk()
+// -----------------------------
+// runs the plugin of the hop over the data. A record-aware plugin is given whole lines
+// only, where the incomplete line at the end is carried to the next chunk
+void Xtee::transformChunk(HopStub& hop, const char* buf, int len)
+{
+  // the scratch is taken over for the call, as the output may come back to another hop
+  // thru the stdin stream
+  std::string out;
+  out.swap(_xfOut);
+  out.clear();
+
+  if (0 == (hop.opts.xf->flags & XTEE_XF_RECORDS))
+    runTransform(hop, buf, len, out);
   else
   {
-    FDSet &fwdset = itIdx->second;
-    for (FDSet::const_iterator it = fwdset.begin(); it != fwdset.end(); it++)
+    const char *p = buf, *end = buf + len;
+    if (!hop.xfCarry.empty())
     {
-      if (*it > 0)
-        ::write(*it, p, n);
+      const char *eol = (const char *)memchr(p, '\n', len);
+      const char *to = (NULL != eol) ? (eol + 1) : end;
+      hop.xfCarry.append(p, to - p);
+      p = to;
+
+      if (NULL != eol || hop.xfCarry.length() > FANIN_RECORD_MAX)
+      {
+        runTransform(hop, hop.xfCarry.data(), hop.xfCarry.length(), out);
+        hop.xfCarry.clear();
+      }
     }
-  }
 
-  // limit the speed
-  if (_kBpsLimit > 0)
-  {
-    stampNow = now();
-    if (_stampLast <= 0)
+    const char *last = (p < end) ? (const char *)memrchr(p, '\n', end - p) : NULL;
+    if (NULL != last)
     {
-      _stampLast = stampNow;
-      _offsetLast = _offsetOrigin;
+      runTransform(hop, p, last + 1 - p, out);
+      p = last + 1;
     }
 
-    int elapsed = stampNow - _stampLast;
-    int bytesBypassed = _offsetOrigin - _offsetLast;
-    if (elapsed > QoS_MEASURE_INTERVAL_MSEC || bytesBypassed > (_kBpsLimit*QoS_MEASURES_PER_SEC))
-    {
-      int msecP = bytesBypassed / _kBpsLimit - elapsed;
+    if (p < end)
+      hop.xfCarry.append(p, end - p);
+  }
+
+  if (!out.empty())
+    stageHop(hop, out.data(), out.length());
+
+  _xfOut.swap(out);
+}
+
+// runTransform()
+// -----------------------------
+void Xtee::runTransform(HopStub& hop, const char* in, int len, std::string& out)
+{
+  if (hop.xfFailed || len <= 0)
+    return;
+
+  if (0 != hop.opts.xf->process(hop.xfState, in, len, appendOutput, &out))
+  {
+    hop.xfFailed = true;
+    errlog(LOGF_ERROR, "transform[%s] failed at link %d->%d, dropping its data", hop.opts.xfPath, hop.fdSrc, hop.fdDest);
+  }
+}
+
+// dropHop()
+// -----------------------------
+// erases the hop, with the instance of its plugin if it isn't shared
+void Xtee::dropHop(int fdSrc, int fdDest)
+{
+  HopIndex::iterator it = _hops.find(FDPair(fdSrc, fdDest));
+  if (_hops.end() == it)
+    return;
+
+  const xtee_transform_t *xf = it->second.opts.xf;
+  if (NULL != xf && 0 == (xf->flags & XTEE_XF_STATELESS) && NULL != xf->close)
+    xf->close(it->second.xfState);
+
+  _coalescing.erase(it->first);
+  _hops.erase(it);
+  _routesDirty = true; // a table compiled meanwhile points to the hop
+}
+
+// passToHop()
+// -----------------------------
+// passes the data that the hop has selected on to the fan-in queue or the target
+void Xtee::passToHop(HopStub& hop, const char* buf, int len)
+{
+  if (hop.opts.records)
+    pendRecords(hop, buf, len);
+  else if (hop.opts.coalesceBytes > 0)
+    coalesceToHop(hop, buf, len);
+  else
+    emitToDest(hop.fdDest, buf, len, -1);
+}
+
+// coalesceToHop()
+// -----------------------------
+// holds the small writes of a chatty source, so that the target takes a single write once
+// the data held reaches the size or the first byte held gets too old. A chunk that is big
+// enough by itself goes on without a copy
+void Xtee::coalesceToHop(HopStub& hop, const char* buf, int len)
+{
+  if (hop.coalesced.empty() && len >= hop.opts.coalesceBytes)
+  {
+    emitToDest(hop.fdDest, buf, len, -1);
+    return;
+  }
+
+  hop.coalesced.append(buf, len);
+  if (hop.coalesced.length() >= (size_t)hop.opts.coalesceBytes)
+  {
+    flushCoalesced(hop);
+    return;
+  }
+
+  if (hop.stampCoalesceDue > 0)
+    return;
+
+  hop.stampCoalesceDue = now() + hop.opts.coalesceMsec;
+  _coalescing.insert(FDPair(hop.fdSrc, hop.fdDest));
+  if (_deadlines[TIMER_COALESCE] <= 0 || hop.stampCoalesceDue < _deadlines[TIMER_COALESCE])
+    setTimer(TIMER_COALESCE, hop.stampCoalesceDue);
+}
+
+// flushCoalesced()
+// -----------------------------
+void Xtee::flushCoalesced(HopStub& hop)
+{
+  _coalescing.erase(FDPair(hop.fdSrc, hop.fdDest));
+  hop.stampCoalesceDue = 0;
+  if (hop.coalesced.empty())
+    return;
+
+  // taken off the hop ahead of the write, as the data may come back thru the stdin stream
+  std::string data;
+  data.swap(hop.coalesced);
+  emitToDest(hop.fdDest, data.data(), data.length(), -1);
+  data.clear();
+  if (hop.coalesced.empty())
+    hop.coalesced.swap(data); // keeps the capacity for the next
+}
+
+// flushCoalescedDue()
+// -----------------------------
+// flushes the hops whose data held is due, then schedules the timer to the next
+void Xtee::flushCoalescedDue(int64_t stampNow)
+{
+  int64_t stampNext = 0;
+  std::vector<FDPair> coalescing(_coalescing.begin(), _coalescing.end());
+  for (size_t i = 0; i < coalescing.size(); i++)
+  {
+    HopStub *hop = hopOf(coalescing[i].first, coalescing[i].second);
+    if (NULL == hop)
+      continue;
+
+    if (hop->stampCoalesceDue <= stampNow)
+      flushCoalesced(*hop);
+    else if (stampNext <= 0 || hop->stampCoalesceDue < stampNext)
+      stampNext = hop->stampCoalesceDue;
+  }
+
+  setTimer(TIMER_COALESCE, stampNext);
+}
+
+// pendRecords()
+// -----------------------------
+void Xtee::pendRecords(HopStub& hop, const char* buf, int len)
+{
+  size_t offset = hop.pending.length();
+  hop.pending.append(buf, len);
+
+  // the records complete at the last delimiter, only the new data has to be scanned
+  const char *last = (const char *)memrchr(hop.pending.data() + offset, '\n', len);
+  if (NULL != last)
+    hop.complete = last - hop.pending.data() + 1;
+
+  if (hop.pending.length() - hop.complete > FANIN_RECORD_MAX)
+    hop.complete = hop.pending.length(); // give up waiting for the delimiter of a huge record
+
+  if (hop.complete > 0)
+    _fanInDests.insert(hop.fdDest);
+}
+
+// selectLines()
+// -----------------------------
+// frames the data into lines and passes on the lines that the hop keeps, so a record
+// is either forwarded whole or not at all. The incomplete line at the end of the data
+// is carried to the next chunk
+void Xtee::selectLines(HopStub& hop, const char* buf, int len)
+{
+  const char *p = buf, *end = buf + len;
+  int64_t stampNow = (SAMPLE_MSEC == hop.opts.sampleMode) ? now() : 0;
+
+  // the scratch is taken over for the call, as the kept lines may come back to another
+  // hop thru the stdin stream
+  std::string out;
+  out.swap(_hopOut);
+  out.clear();
+
+  if (!hop.carry.empty())
+  {
+    const char *eol = (const char *)memchr(p, '\n', len);
+    const char *to = (NULL != eol) ? (eol + 1) : end;
+    hop.carry.append(p, to - p);
+    p = to;
+
+    // the carried line completes here, or is given up as a record if it grows too long
+    if (NULL == eol && hop.carry.length() <= FANIN_RECORD_MAX)
+    {
+      _hopOut.swap(out);
+      return;
+    }
+
+    if (keepLine(hop, hop.carry.data(), hop.carry.length(), stampNow))
+      out += hop.carry;
+    hop.carry.clear();
+  }
+
+  while (p < end)
+  {
+    // a substring filter searches the whole rest of the chunk, and skips the lines
+    // up to the next occurrence at once
+    if (NULL != hop.opts.grep)
+    {
+      const char *found = findSubstr(p, end - p, hop.opts.grep, hop.opts.grepLen);
+      const char *skipTo = (const char *)memrchr(p, '\n', ((NULL != found) ? found : end) - p);
+      if (NULL != skipTo)
+        p = skipTo + 1;
+    }
+
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (NULL == eol)
+    {
+      hop.carry.assign(p, end - p);
+      break;
+    }
+
+    if (keepLine(hop, p, eol + 1 - p, stampNow))
+      out.append(p, eol + 1 - p);
+    p = eol + 1;
+  }
+
+  if (!out.empty())
+    passToHop(hop, out.data(), out.length());
+
+  _hopOut.swap(out);
+}
+
+// keepLine()
+// -----------------------------
+//@return true if the hop keeps the line for its target
+bool Xtee::keepLine(HopStub& hop, const char* line, int len, int64_t stampNow)
+{
+  if (NULL != hop.opts.grep && NULL == findSubstr(line, len, hop.opts.grep, hop.opts.grepLen))
+    return false;
+
+  if (NULL != hop.opts.regex)
+  {
+    // matches within the line without its delimiter, so that $ anchors at the end
+    regmatch_t range;
+    range.rm_so = 0;
+    range.rm_eo = (len > 0 && '\n' == line[len - 1]) ? (len - 1) : len;
+    if (0 != regexec(hop.opts.regex, line, 1, &range, REG_STARTEND))
+      return false;
+  }
+
+  switch (hop.opts.sampleMode)
+  {
+  case SAMPLE_NTH:
+    return 0 == (hop.seen++ % hop.opts.sampleArg);
+
+  case SAMPLE_PERCENT:
+    hop.rand ^= hop.rand << 13;
+    hop.rand ^= hop.rand >> 17;
+    hop.rand ^= hop.rand << 5;
+    return hop.rand < hop.opts.sampleArg;
+
+  case SAMPLE_MSEC:
+    if (stampNow - hop.stampKept < (int64_t)hop.opts.sampleArg)
+      return false;
+
+    hop.stampKept = stampNow;
+    return true;
+  }
+
+  return true;
+}
+
+// drainFanIns()
+// -----------------------------
+// forwards the complete records queued for the fan-in destinations. The sources of
+// a destination take turns by deficit round-robin, where each gains FANIN_QUANTUM
+// bytes of credit per weight a turn and sends the whole records that fit in its
+// credit. The turns repeat till all the complete records are forwarded, so DRR only
+// interleaves the records of a round; the share of each source comes from the reads
+// it takes a round by its weight. The first source to serve rotates so that no one
+// is always ahead
+void Xtee::drainFanIns()
+{
+  for (FDSet::iterator it = _fanInDests.begin(); it != _fanInDests.end(); it++)
+  {
+    int fdDest = *it;
+    FDIndex::iterator itSrcs = _fd2src.find(fdDest);
+    if (_fd2src.end() == itSrcs)
+      continue;
+
+    std::vector<HopStub *> hops;
+    for (FDSet::iterator itSrc = itSrcs->second.begin(); itSrc != itSrcs->second.end(); itSrc++)
+    {
+      HopStub *hop = hopOf(*itSrc, fdDest);
+      if (NULL != hop && hop->opts.records)
+        hops.push_back(hop);
+    }
+
+    if (hops.empty())
+      continue;
+
+    size_t first = _fanInRR[fdDest]++ % hops.size();
+    for (bool more = true; more;)
+    {
+      more = false;
+      for (size_t k = 0; k < hops.size(); k++)
+      {
+        HopStub *hop = hops[(first + k) % hops.size()];
+        if (hop->complete <= 0)
+        {
+          hop->deficit = 0;
+          continue;
+        }
+
+        hop->deficit += FANIN_QUANTUM * hop->opts.weight;
+
+        // take the leading records that fit in the deficit
+        const char *data = hop->pending.data();
+        size_t len = 0;
+        while (len < hop->complete)
+        {
+          const char *eor = (const char *)memchr(data + len, '\n', hop->complete - len);
+          size_t next = (NULL != eor) ? (eor - data + 1) : hop->complete;
+          if (next > (size_t)hop->deficit)
+            break;
+
+          len = next;
+        }
+
+        if (len > 0)
+        {
+          emitToDest(fdDest, data, len, -1);
+          hop->pending.erase(0, len);
+          hop->complete -= len;
+          hop->deficit -= len;
+        }
+
+        if (hop->complete > 0)
+          more = true;
+      }
+    }
+  }
+
+  _fanInDests.clear();
+}
+
+// flushHopsFrom()
+// -----------------------------
+// forwards whatever queued from a source that is about to close, including the
+// incomplete record at the tail
+void Xtee::flushHopsFrom(int fdSrc)
+{
+  for (HopIndex::iterator it = _hops.lower_bound(FDPair(fdSrc, INT_MIN)); it != _hops.end() && it->first.first == fdSrc; it++)
+  {
+    HopStub &hop = it->second;
+    if (!hop.xfCarry.empty())
+    {
+      std::string out;
+      runTransform(hop, hop.xfCarry.data(), hop.xfCarry.length(), out);
+      hop.xfCarry.clear();
+      if (!out.empty())
+        stageHop(hop, out.data(), out.length());
+    }
+
+    if (!hop.carry.empty() && keepLine(hop, hop.carry.data(), hop.carry.length(), now()))
+      passToHop(hop, hop.carry.data(), hop.carry.length());
+    hop.carry.clear();
+    flushCoalesced(hop);
+
+    if (hop.pending.empty())
+      continue;
+
+    emitToDest(hop.fdDest, hop.pending.data(), hop.pending.length(), -1);
+    hop.pending.clear();
+    hop.complete = 0;
+  }
+}
+
+// hopOf()
+// -----------------------------
+Xtee::HopStub* Xtee::hopOf(int fdSrc, int fdDest)
+{
+  HopIndex::iterator it = _hops.find(FDPair(fdSrc, fdDest));
+  return (_hops.end() == it) ? NULL : &it->second;
+}
+
+// stdinQoS()
+// -----------------------------
+int Xtee::stdinQoS(const char* buf, int n)
+{
+  if (n <=0)
+    return 0;
+
+  int64_t stampNow = now();
+
+  // yield if stamp start is defined and not meet
+  if (_stampStart >0 && _stampStart > stampNow)
+    return n;
+
+  if (_stampStart<=0)
+  {
+    _stampStart = stampNow;
+    if (_options.secsDuration >0)
+      setTimer(TIMER_DURATION, _stampStart + _options.secsDuration *1000);
+  }
+
+  if (_options.secsDuration >0 && stampNow >(_stampStart + _options.secsDuration *1000))
+    _bQuit = true;
+
+  const char * p = buf;
+  
+  // yield if the leading yield bytes is specified
+  if (_options.bytesToSkip >0)
+  {
+    if ((_offsetOrigin +n) <= _options.bytesToSkip)
+      return n;
+  
+    if (_offsetOrigin <_options.bytesToSkip)
+    {
+      uint bytesToSkip = _options.bytesToSkip - _offsetOrigin;
+      p += bytesToSkip;
+      n -= bytesToSkip;
+    }
+  }
+
+  _offsetOrigin += n;
+
+  // forward the data
+  RouteView route;
+  if (!routeOf(STDIN_FILENO, route)) // if (fwdset.empty())
+    ::write(STDOUT_FILENO, p, n);
+  else
+  {
+    for (int i = 0; i < route.ndests; i++)
+    {
+      if (route.dests[i] <= 0 || (NULL != route.hops && queueToHop(route.hops[i], p, n)))
+        continue;
+
+      forwardTo(route.dests[i], p, n);
+    }
+  }
+
+  // limit the speed
+  if (_kBpsLimit > 0)
+  {
+    stampNow = now();
+    if (_stampLast <= 0)
+    {
+      _stampLast = stampNow;
+      _offsetLast = _offsetOrigin;
+    }
+
+    int elapsed = stampNow - _stampLast;
+    int bytesBypassed = _offsetOrigin - _offsetLast;
+    if (elapsed > QoS_MEASURE_INTERVAL_MSEC || bytesBypassed > (_kBpsLimit*QoS_MEASURES_PER_SEC))
+    {
+      int msecP = bytesBypassed / _kBpsLimit - elapsed;
       int msecI = (_offsetOrigin - _options.bytesToSkip) / _kBpsLimit - (stampNow - _stampStart);
       int v = (elapsed >0) ? (bytesBypassed / elapsed) : (_lastv <<1);
       int msecV = (v > _lastv) ? 1 : -1;
@@ -248,58 +1174,831 @@ int Xtee::stdinQoS(const char* buf, int n)
       _lastv = v;
       _stampLast = stampNow;
 
-      while (!_bQuit && msecYield > 0)
-      {
-        int msecSleep = MIN(500, msecYield); // up to 500msec per step to check _bQuit
-        msecYield -= msecSleep;
-        ::usleep(msecSleep * 1000);
-      }
+      // rather than sleeping, pause reading the feeds of stdin until the yield is over,
+      // the links that don't go thru stdin keep on
+      if (msecYield > 0)
+      {
+        _stampStdinResume = stampNow + msecYield;
+        setTimer(TIMER_RATE, _stampStdinResume);
+      }
+    }
+  }
+
+  return n;
+}
+
+// forwardTo()
+// -----------------------------
+// writes a chunk to a destination, the taps never block the forwarding unless
+// they asked to be lossless
+int Xtee::forwardTo(int fdDest, const char* buf, int len)
+{
+  if (fdDest >= (int)_fdFlags.size() || 0 == (_fdFlags[fdDest] & (FDF_TAP | FDF_SINK)))
+  {
+    if (fdDest < (int)_fdFlows.size())
+      _fdFlows[fdDest].bytes += len, _fdFlows[fdDest].total += len;
+    return ::write(fdDest, buf, len);
+  }
+
+  if (_fdFlags[fdDest] & FDF_SINK)
+  {
+    endpointOf(fdDest)->consume(buf, len);
+    return len;
+  }
+
+  TapIndex::iterator itTap = _taps.find(fdDest);
+  if (_taps.end() == itTap)
+    return ::write(fdDest, buf, len);
+
+  TapStub &tap = itTap->second;
+  int sent = 0;
+  while (sent < len)
+  {
+    int n = ::send(fdDest, buf + sent, len - sent, MSG_NOSIGNAL | (tap.lossless ? 0 : MSG_DONTWAIT));
+    if (n < 0 && EINTR == errno)
+      continue;
+
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+      break; // the tap is slow, drop the rest of this chunk
+
+    if (n <= 0)
+    {
+      _tapsGone.insert(fdDest); // detach it after this forwarding round
+      return -1;
+    }
+
+    sent += n;
+    if (!tap.lossless)
+      break;
+  }
+
+  tap.bytes += sent;
+  tap.drops += len - sent;
+  return sent;
+}
+
+// lookupSrcFd()
+// -----------------------------
+//@return the fd of source in the format of -l <SOURCE>, -1 if not available
+int Xtee::lookupSrcFd(int childId, int childFd)
+{
+  if (childId < 0 || childId > (int)_children.size() || (childFd != STDOUT_FILENO && childFd != STDERR_FILENO))
+    return -1;
+
+  if (childId > 0)
+    return _children[childId - 1].stdio[childFd];
+
+  return (childFd == STDOUT_FILENO) ? STDIN_FILENO : -1;
+}
+
+// acceptTaps()
+// -----------------------------
+void Xtee::acceptTaps()
+{
+  int fd = -1;
+  while ((fd = ::accept4(_fdTapListener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    _tapRequests[fd] = "";
+    errlog(LOGF_TRACE, "accepted tap connection fd(%d)", fd);
+  }
+}
+
+// readTapRequest()
+// -----------------------------
+// a tap request is a single line of "<SOURCE> [lossy|lossless]", where <SOURCE>
+// is in the same format of -l option
+void Xtee::readTapRequest(int fd)
+{
+  char req[TAP_REQUEST_MAX];
+  int n = ::recv(fd, req, sizeof(req), 0);
+  if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno))
+    return;
+
+  if (n <= 0)
+  {
+    ::close(fd);
+    _tapRequests.erase(fd);
+    return;
+  }
+
+  std::string &line = _tapRequests[fd];
+  line.append(req, n);
+  size_t pos = line.find('\n');
+  if (std::string::npos == pos && line.length() < TAP_REQUEST_MAX)
+    return; // wait for more
+
+  if (std::string::npos != pos)
+    line.erase(pos);
+
+  int childId = 0, childFd = -1;
+  char policy[16] = "";
+  if (sscanf(line.c_str(), "%d.%d %15s", &childId, &childFd, policy) < 2)
+  {
+    childId = 0;
+    sscanf(line.c_str(), "%d %15s", &childFd, policy);
+  }
+
+  const char *err = NULL;
+  bool lossless = (0 == strcmp(policy, "lossless"));
+  int fdSrc = lookupSrcFd(childId, childFd);
+
+  if (!lossless && '\0' != policy[0] && 0 != strcmp(policy, "lossy"))
+    err = "unknown policy";
+  else if (fdSrc < 0 || (STDIN_FILENO != fdSrc && _fd2fwd.end() == _fd2fwd.find(fdSrc)))
+    err = "no such source";
+
+  if (NULL != err)
+  {
+    errlog(LOGF_ERROR, "rejected tap fd(%d) request[%s]: %s", fd, line.c_str(), err);
+    std::string resp = std::string("ERR ") + err + "\n";
+    ::send(fd, resp.c_str(), resp.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    ::close(fd);
+    _tapRequests.erase(fd);
+    return;
+  }
+
+  if (lossless)
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  // xtee stdin goes to stdout by default only if it has no link, so keep it
+  if (STDIN_FILENO == fdSrc && _fd2fwd.end() == _fd2fwd.find(STDIN_FILENO))
+    link(STDIN_FILENO, STDOUT_FILENO);
+
+  TapStub tap;
+  tap.fdSrc = fdSrc;
+  tap.lossless = lossless;
+  tap.bytes = tap.drops = 0;
+  _taps[fd] = tap;
+  _tapRequests.erase(fd);
+  setFdFlags(fd, FDF_TAP);
+  link(fdSrc, fd);
+
+  errlog(LOGF_TRACE, "attached %s tap fd(%d) to CH%02d.%d fd(%d)", lossless ? "lossless" : "lossy", fd, childId, childFd, fdSrc);
+}
+
+// closeGoneTaps()
+// -----------------------------
+// detaches the taps that failed at writing, and forgets about those have been
+// closed along with their sources
+void Xtee::closeGoneTaps()
+{
+  for (FDSet::iterator it = _tapsGone.begin(); it != _tapsGone.end(); it++)
+  {
+    int fd = *it;
+    if (_fd2src.end() != _fd2src.find(fd))
+      closeDestFd(fd);
+    else
+      ::close(fd);
+  }
+
+  for (TapIndex::iterator it = _taps.begin(); it != _taps.end();)
+  {
+    int fd = it->first;
+    TapStub &tap = (it++)->second;
+    if (_tapsGone.end() == _tapsGone.find(fd) && _fd2src.end() != _fd2src.find(fd))
+      continue;
+
+    errlog(LOGF_TRACE, "detached tap fd(%d) from fd(%d): %lld bytes sent, %lld dropped", fd, tap.fdSrc, (long long)tap.bytes, (long long)tap.drops);
+    _taps.erase(fd);
+    setFdFlags(fd, 0);
+  }
+
+  _tapsGone.clear();
+}
+
+// reapChild()
+// -----------------------------
+// collects the exit status and resource usage of the child if it has exited,
+// then closes its pipes
+//@return true if the child has gone
+bool Xtee::reapChild(ChildStub &child)
+{
+  pid_t wpid = wait4(child.pid, &child.status, WNOHANG | WUNTRACED, &child.rusage); // instantly return
+  if (0 == wpid) // WNOHANG returns 0 when child is still running
+    return false;
+
+  closePipesToChild(child);
+  if (wpid == child.pid)
+    errlog(LOGF_TRACE, "detected CH%02u pid(%d) exited w/ status(0x%x) user(%ld.%03lds) sys(%ld.%03lds) maxrss(%ldKB) csw(%ld/%ld) blk(%ld/%ld): %s", child.idx, child.pid, child.status,
+           (long)child.rusage.ru_utime.tv_sec, (long)child.rusage.ru_utime.tv_usec / 1000, (long)child.rusage.ru_stime.tv_sec, (long)child.rusage.ru_stime.tv_usec / 1000,
+           child.rusage.ru_maxrss, child.rusage.ru_nvcsw, child.rusage.ru_nivcsw, child.rusage.ru_inblock, child.rusage.ru_oublock, child.cmd);
+  else
+    errlog(LOGF_TRACE, "detected CH%02u pid(%d) gone: %s", child.idx, child.pid, child.cmd);
+
+  if (child.pidfd >= 0)
+    ::close(child.pidfd);
+
+  child.pidfd = -1;
+  child.pid = -1;
+  return true;
+}
+
+// setTimer()
+// -----------------------------
+void Xtee::setTimer(int timer, int64_t stampDue)
+{
+  _deadlines[timer] = stampDue;
+  armTimer();
+}
+
+// armTimer()
+// -----------------------------
+// arms the timerfd to the earliest deadline, only if it changes
+void Xtee::armTimer()
+{
+  int64_t stampDue = 0;
+  for (int i = 0; i < TIMER_MAX; i++)
+  {
+    if (_deadlines[i] > 0 && (stampDue <= 0 || _deadlines[i] < stampDue))
+      stampDue = _deadlines[i];
+  }
+
+  if (stampDue == _stampArmed || _fdTimer < 0)
+    return;
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its)); // all zero disarms the timer
+  if (stampDue > 0)
+  {
+    its.it_value.tv_sec = stampDue / 1000;
+    its.it_value.tv_nsec = (stampDue % 1000) * 1000000;
+  }
+
+  ::timerfd_settime(_fdTimer, TFD_TIMER_ABSTIME, &its, NULL);
+  _stampArmed = stampDue;
+}
+
+// onTimers()
+// -----------------------------
+//@return the bitmask of the timers that have fired
+unsigned Xtee::onTimers()
+{
+  uint64_t expirations = 0;
+  if (::read(_fdTimer, &expirations, sizeof(expirations)) < 0 && EAGAIN != errno)
+    errlog(LOGF_ERROR, "failed to read timerfd: %s(%d)", strerror(errno), errno);
+
+  _stampArmed = 0; // an absolute timer fires only once
+  unsigned fired = 0;
+  int64_t stampNow = now();
+  for (int i = 0; i < TIMER_MAX; i++)
+  {
+    if (_deadlines[i] <= 0 || _deadlines[i] > stampNow)
+      continue;
+
+    _deadlines[i] = 0;
+    fired |= (1 << i);
+  }
+
+  // the activity only leaves a stamp, the idle timer checks it when due
+  if (fired & (1 << TIMER_IDLE))
+  {
+    if (stampNow - _stampActivity < _options.secsTimeout *1000)
+      setTimer(TIMER_IDLE, _stampActivity + _options.secsTimeout *1000);
+    else
+    {
+      errlog(LOGF_TRACE, "stopping as no data in %d secs", _options.secsTimeout);
+      _bQuit = true;
+    }
+  }
+
+  if (fired & (1 << TIMER_DURATION))
+  {
+    errlog(LOGF_TRACE, "stopping as the duration of %d secs is reached", _options.secsDuration);
+    _bQuit = true;
+  }
+
+  if (fired & (1 << TIMER_RATE))
+    _stampStdinResume = 0;
+
+  if (fired & (1 << TIMER_COALESCE))
+    flushCoalescedDue(stampNow);
+
+  if (fired & (1 << TIMER_ADAPT))
+    adaptPipes(stampNow);
+
+  if (fired & (1 << TIMER_PROFILE))
+    profileChildren(stampNow);
+
+  armTimer();
+  return fired;
+}
+
+// sampleChild()
+// -----------------------------
+//@return false if the child is gone from /proc
+bool Xtee::sampleChild(ChildStub& child, ProcSample& sample)
+{
+  char path[64], line[512];
+  memset(&sample, 0, sizeof(sample));
+
+  // the fields of stat after the command in parentheses, which may contain spaces, starting
+  // from the 3rd: state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime
+  snprintf(path, sizeof(path), "/proc/%d/stat", child.pid);
+  FILE *fp = fopen(path, "r");
+  if (NULL == fp)
+    return false;
+
+  const char *fields = (NULL != fgets(line, sizeof(line), fp)) ? strrchr(line, ')') : NULL;
+  fclose(fp);
+  unsigned long long utime = 0, stime = 0;
+  if (NULL == fields || 2 != sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime))
+    return false;
+  sample.cpuTicks = utime + stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", child.pid);
+  if (NULL != (fp = fopen(path, "r")))
+  {
+    long long v = 0;
+    while (NULL != fgets(line, sizeof(line), fp))
+    {
+      if (1 == sscanf(line, "VmRSS: %lld", &v))
+        sample.rssKB = v;
+      else if (1 == sscanf(line, "voluntary_ctxt_switches: %lld", &v))
+        sample.nvcsw = v;
+      else if (1 == sscanf(line, "nonvoluntary_ctxt_switches: %lld", &v))
+        sample.nivcsw = v;
+    }
+    fclose(fp);
+  }
+
+  // io is readable only to the same user, it stays zero otherwise
+  snprintf(path, sizeof(path), "/proc/%d/io", child.pid);
+  if (NULL != (fp = fopen(path, "r")))
+  {
+    long long v = 0;
+    while (NULL != fgets(line, sizeof(line), fp))
+    {
+      if (1 == sscanf(line, "rchar: %lld", &v))
+        sample.rchar = v;
+      else if (1 == sscanf(line, "wchar: %lld", &v))
+        sample.wchar = v;
+      else if (1 == sscanf(line, "read_bytes: %lld", &v))
+        sample.readBytes = v;
+      else if (1 == sscanf(line, "write_bytes: %lld", &v))
+        sample.writeBytes = v;
+    }
+    fclose(fp);
+  }
+
+  if (CHILDIN(child) >= 0)
+    sample.linkIn = flowOf(CHILDIN(child)).total;
+  if (CHILDOUT(child) >= 0)
+    sample.linkOut += flowOf(CHILDOUT(child)).total;
+  if (CHILDERR(child) >= 0)
+    sample.linkOut += flowOf(CHILDERR(child)).total;
+
+  return true;
+}
+
+// profileChildren()
+// -----------------------------
+// samples every live child and logs a line per child of the rates during the interval, so
+// that the log reads as a timeline per stage: a stage near 100% cpu is CPU-bound, while one
+// with low cpu and high voluntary switches mostly waits on its I/O or its neighbours
+void Xtee::profileChildren(int64_t stampNow)
+{
+  static const long ticksPerSec = sysconf(_SC_CLK_TCK);
+  for (size_t i = 0; i < _children.size(); i++)
+  {
+    ChildStub &child = _children[i];
+    ProcSample sample;
+    if (child.pid <= 0 || !sampleChild(child, sample))
+      continue;
+
+    sample.stamp = stampNow;
+    ProcSample &last = child.sample;
+    if (last.stamp > 0 && stampNow > last.stamp)
+    {
+      double secs = (stampNow - last.stamp) / 1000.0, MB = 1024.0 * 1024.0;
+      errlog(LOGF_TRACE, "CH%02u prof +%.1fs cpu(%.1f%%) rss(%lldKB) rw(%.2f/%.2fMB/s) disk(%.2f/%.2fMB/s) csw(%.0f/%.0f/s) link(in %.2f, out %.2fMB/s)",
+             child.idx, (stampNow - _stampProfileStart) / 1000.0,
+             (sample.cpuTicks - last.cpuTicks) * 100.0 / ticksPerSec / secs, (long long)sample.rssKB,
+             (sample.rchar - last.rchar) / MB / secs, (sample.wchar - last.wchar) / MB / secs,
+             (sample.readBytes - last.readBytes) / MB / secs, (sample.writeBytes - last.writeBytes) / MB / secs,
+             (sample.nvcsw - last.nvcsw) / secs, (sample.nivcsw - last.nivcsw) / secs,
+             MAX(sample.linkIn - last.linkIn, 0) / MB / secs, MAX(sample.linkOut - last.linkOut, 0) / MB / secs);
+    }
+
+    last = sample;
+  }
+
+  setTimer(TIMER_PROFILE, stampNow + _options.msecProfile);
+}
+
+// closePipesToChild()
+// -----------------------------
+void Xtee::closePipesToChild(ChildStub &child)
+{
+  std::string batch;
+  bool hasFeedToStdin = (_fd2src.end() != _fd2src.find(STDIN_FILENO));
+
+  if (CHILDIN(child) > STDERR_FILENO)
+    batch += closeDestFd(CHILDIN(child)) + ","; // STDIN of the chhild
+
+  drainSrcFd(CHILDOUT(child), child.idx);
+  drainSrcFd(CHILDERR(child), child.idx);
+
+  if (CHILDOUT(child) > STDERR_FILENO)
+    batch += closeSrcFd(CHILDOUT(child)) + ","; // STDOUT of the chhild
+
+  if (CHILDERR(child) > STDERR_FILENO)
+    batch += closeSrcFd(CHILDERR(child)); // STDERR of the chhild
+
+  if (_childsToStdin >0 && hasFeedToStdin && (_fd2src.end() == _fd2src.find(STDIN_FILENO))) // this is the last child who feeds xtee stdin
+  {
+    int tmp =STDIN_FILENO;
+    batch += std::string(",") +closeSrcFd(tmp);
+  }
+
+  errlog(LOGF_TRACE, "closed link(s) of CH%02d[%s]: %s", child.idx, child.cmd, batch.c_str());
+  // printLinks();
+}
+
+// closeStdin()
+// -----------------------------
+// stops watching the stdin at its EOF, which would otherwise keep it readable. If no child
+// feeds the stdin stream, the links from it are closed so that the targets get the EOF too
+void Xtee::closeStdin()
+{
+  _bStdinEOF = true;
+  if (_childsToStdin > 0)
+    return;
+
+  FDIndex::iterator it = _fd2fwd.find(STDIN_FILENO);
+  FDSet dests;
+  if (_fd2fwd.end() != it)
+    dests = it->second;
+
+  int tmp = STDIN_FILENO;
+  std::string batch = closeSrcFd(tmp);
+
+  // the stdin of the children that were fed by the stream only has been closed with it
+  for (size_t i = 0; i < _children.size(); i++)
+  {
+    ChildStub &child = _children[i];
+    if (dests.count(CHILDIN(child)) && _fd2src.end() == _fd2src.find(CHILDIN(child)))
+      CHILDIN(child) = -1;
+  }
+
+  errlog(LOGF_TRACE, "EOF at stdin, closed link(s): %s", batch.c_str());
+}
+
+// parseLink()
+// -----------------------------
+// parses a link in the format of -l <TARGET>:<SOURCE>
+bool Xtee::parseLink(char* link, LinkSpec& spec)
+{
+  initLinkOpts(spec.opts);
+
+  char *opts = strchr(link, ',');
+  if (NULL != opts)
+    *opts++ = '\0';
+
+  char *dest = strtok(link, ":"), *src = strtok(0, ":"); // char *delimitor = strchr(_fdLinks[i], ':'); // strchr(_fdLinks[i].c_str(), ':');
+  if (NULL == dest || NULL == src)
+    return false;
+
+  int childIdDest = 0, childFdDest = -1, childIdSrc = 0, childFdSrc = -1;
+  char *strChildId = strtok(dest, ".");
+  char *strfd = strtok(0, ".");
+  if (NULL != strfd)
+  {
+    childFdDest = atoi(strfd);
+    childIdDest = atoi(strChildId);
+  }
+  else
+  {
+    childIdDest = atoi(strChildId);
+    childFdDest = 0;
+  }
+
+  strChildId = strtok(src, ".");
+  strfd = strtok(0, ".");
+  if (NULL != strfd)
+  {
+    childFdSrc = atoi(strfd);
+    childIdSrc = atoi(strChildId);
+  }
+  else
+  {
+    childIdSrc = 0;
+    childFdSrc = atoi(strChildId);
+  }
+
+  if (childIdDest > (int)_childCommands.size() || childIdSrc > (int)_childCommands.size() || STDIN_FILENO != childFdDest || (childFdSrc != STDOUT_FILENO && childFdSrc != STDERR_FILENO))
+  {
+    errlog(LOGF_ERROR, "skip invalid link CH%02d:%d<-CH%02d:%d", childIdDest, childFdDest, childIdSrc, childFdSrc);
+    return false;
+  }
+
+  // the options go last, as the regex and the plugin they load are released if the link is skipped
+  if (NULL != opts && !parseLinkOpts(opts, spec.opts))
+  {
+    freeLinkOpts(spec.opts);
+    return false;
+  }
+
+  spec.childIdDest = childIdDest;
+  spec.childFdDest = childFdDest;
+  spec.childIdSrc = childIdSrc;
+  spec.childFdSrc = childFdSrc;
+  spec.wire[0] = spec.wire[1] = -1;
+  return true;
+}
+
+bool Xtee::selectsLines(const LinkOpts& linkOpts)
+{
+  return SAMPLE_NONE != linkOpts.sampleMode || NULL != linkOpts.grep || NULL != linkOpts.regex;
+}
+
+void Xtee::initLinkOpts(LinkOpts& linkOpts)
+{
+  memset(&linkOpts, 0, sizeof(linkOpts));
+  linkOpts.weight = 1;
+  linkOpts.prio = LINK_PRIO_DEFAULT;
+}
+
+// freeLinkOpts()
+// -----------------------------
+// releases what the options of a skipped link have compiled or loaded
+void Xtee::freeLinkOpts(LinkOpts& linkOpts)
+{
+  if (NULL != linkOpts.regex)
+  {
+    regfree(linkOpts.regex);
+    delete linkOpts.regex;
+  }
+
+  if (NULL != linkOpts.xf && NULL != linkOpts.xfShared && NULL != linkOpts.xf->close)
+    linkOpts.xf->close(linkOpts.xfShared);
+
+  if (NULL != linkOpts.xfLib)
+    ::dlclose(linkOpts.xfLib);
+
+  initLinkOpts(linkOpts);
+}
+
+// parseLinkOpts()
+// -----------------------------
+// parses the comma-separated options of a link:
+//   relay     keeps xtee in the data path of the link
+//   rec       forwards complete lines only, fanning in with the other sources of the target
+//   w=<n>     the reads per round of the source, n times those of a w=1 source, implies rec
+//   prio=<p>  the priority class of high|normal|bulk, or 0-2
+//   sample=<n>|<p>%|<t>ms  forwards every nth line, a random p% of the lines, or a line per t msec
+//   grep=<substr>  forwards only the lines containing the substring
+//   re=<regex>     forwards only the lines matching the POSIX extended regex
+//   xf=<path.so>[:<arg>]  transforms the data by the plugin, see xtee_plugin.h
+//   coalesce=<bytes>[/<msec>]  holds the small writes till so many bytes or so old
+bool Xtee::parseLinkOpts(char* opts, LinkOpts& linkOpts)
+{
+  char *saveptr = NULL;
+  for (char *opt = strtok_r(opts, ",", &saveptr); NULL != opt; opt = strtok_r(NULL, ",", &saveptr))
+  {
+    char *value = strchr(opt, '=');
+    if (NULL != value)
+      *value++ = '\0';
+
+    if (0 == strcmp(opt, "relay"))
+      ;
+    else if (0 == strcmp(opt, "rec"))
+      linkOpts.records = true;
+    else if (0 == strcmp(opt, "w") && NULL != value && atoi(value) > 0)
+    {
+      linkOpts.records = true;
+      linkOpts.weight = atoi(value);
+    }
+    else if (0 == strcmp(opt, "prio") && NULL != value)
+    {
+      static const char *names[LINK_PRIO_CLASSES] = {"high", "normal", "bulk"};
+      linkOpts.prio = -1;
+      for (int i = 0; i < LINK_PRIO_CLASSES; i++)
+      {
+        if (0 == strcmp(value, names[i]) || (isdigit(value[0]) && atoi(value) == i))
+          linkOpts.prio = i;
+      }
+
+      if (linkOpts.prio < 0)
+      {
+        errlog(LOGF_ERROR, "skip link of invalid priority: %s", value);
+        return false;
+      }
+    }
+    else if (0 == strcmp(opt, "sample") && NULL != value)
+    {
+      char *unit = NULL;
+      double arg = strtod(value, &unit);
+      if ('%' == *unit && '\0' == unit[1] && arg > 0 && arg <= 100)
+      {
+        linkOpts.sampleMode = SAMPLE_PERCENT;
+        linkOpts.sampleArg = (uint64_t)(arg / 100 * 4294967296.0);
+      }
+      else if (0 == strcmp(unit, "ms") && arg >= 1)
+      {
+        linkOpts.sampleMode = SAMPLE_MSEC;
+        linkOpts.sampleArg = (uint64_t)arg;
+      }
+      else if ('\0' == *unit && arg >= 1 && arg == (uint64_t)arg)
+      {
+        linkOpts.sampleMode = SAMPLE_NTH;
+        linkOpts.sampleArg = (uint64_t)arg;
+      }
+      else
+      {
+        errlog(LOGF_ERROR, "skip link of invalid sampling: %s", value);
+        return false;
+      }
+    }
+    else if (0 == strcmp(opt, "grep") && NULL != value && '\0' != *value && NULL == strchr(value, '\n'))
+    {
+      linkOpts.grep = value;
+      linkOpts.grepLen = strlen(value);
+    }
+    else if (0 == strcmp(opt, "re") && NULL != value)
+    {
+      regex_t *regex = new regex_t;
+      int rc = regcomp(regex, value, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+      if (0 != rc)
+      {
+        char err[LOG_LINE_MAX_BUF];
+        regerror(rc, regex, err, sizeof(err));
+        errlog(LOGF_ERROR, "skip link of invalid regex[%s]: %s", value, err);
+        delete regex;
+        return false;
+      }
+
+      linkOpts.re = value;
+      linkOpts.regex = regex;
+    }
+    else if (0 == strcmp(opt, "xf") && NULL != value)
+    {
+      if (!loadTransform(value, linkOpts))
+        return false;
+    }
+    else if (0 == strcmp(opt, "coalesce") && NULL != value)
+    {
+      char *msec = NULL;
+      linkOpts.coalesceBytes = strtol(value, &msec, 10);
+      linkOpts.coalesceMsec = ('/' == *msec) ? atoi(msec + 1) : COALESCE_MSEC_DEFAULT;
+      if (linkOpts.coalesceBytes <= 0 || linkOpts.coalesceBytes > COALESCE_BYTES_MAX || linkOpts.coalesceMsec <= 0 || ('/' != *msec && '\0' != *msec))
+      {
+        errlog(LOGF_ERROR, "skip link of invalid coalescing: %s", value);
+        return false;
+      }
+    }
+    else
+    {
+      errlog(LOGF_ERROR, "skip link of invalid option: %s", opt);
+      return false;
+    }
+
+    linkOpts.relay = true;
+  }
+
+  return true;
+}
+
+// loadTransform()
+// -----------------------------
+// loads the plugin of xf=<path.so>[:<arg>], which stays loaded for the lifetime of xtee
+bool Xtee::loadTransform(char* value, LinkOpts& linkOpts)
+{
+  char *arg = strchr(value, ':');
+  if (NULL != arg)
+    *arg++ = '\0';
+
+  void *lib = ::dlopen(value, RTLD_NOW | RTLD_LOCAL);
+  xtee_transform_fn entry = (NULL != lib) ? (xtee_transform_fn)::dlsym(lib, XTEE_TRANSFORM_SYMBOL) : NULL;
+  const xtee_transform_t *xf = (NULL != entry) ? entry() : NULL;
+  if (NULL == xf || XTEE_PLUGIN_ABI != xf->abi || NULL == xf->process)
+  {
+    errlog(LOGF_ERROR, "skip link of invalid transform[%s]: %s", value, (NULL == lib || NULL == entry) ? dlerror() : "unsupported abi");
+    if (NULL != lib)
+      ::dlclose(lib);
+    return false;
+  }
+
+  linkOpts.xfPath = value;
+  linkOpts.xfArg = arg;
+  linkOpts.xf = xf;
+  linkOpts.xfLib = lib;
+  if ((xf->flags & XTEE_XF_STATELESS) && NULL != xf->open)
+    linkOpts.xfShared = xf->open(arg);
+
+  errlog(LOGF_TRACE, "loaded transform[%s] flags(0x%x)", value, xf->flags);
+  return true;
+}
+
+// wireLinks()
+// -----------------------------
+// takes xtee out of the data path of the plain 1:1 links between two children:
+// the source has no other target, and the target has no other source. Such a
+// link gets a pipe that the two children share directly, xtee only supervises
+// the processes
+void Xtee::wireLinks()
+{
+  if (NULL != _options.tapSocket)
+    return; // a tap needs xtee in the data path to copy the stream
+
+  std::map<int, int> srcRefs, destRefs;
+  for (size_t i = 0; i < _links.size(); i++)
+  {
+    srcRefs[_links[i].childIdSrc * 3 + _links[i].childFdSrc]++;
+    destRefs[_links[i].childIdDest]++;
+  }
+
+  for (size_t i = 0; i < _links.size(); i++)
+  {
+    LinkSpec &spec = _links[i];
+    if (spec.opts.relay || spec.childIdSrc <= 0 || spec.childIdDest <= 0 || spec.childIdSrc == spec.childIdDest)
+      continue;
+
+    if (_endpoints.count(spec.childIdSrc) || _endpoints.count(spec.childIdDest))
+      continue; // an endpoint lives in xtee
+
+    if (srcRefs[spec.childIdSrc * 3 + spec.childFdSrc] != 1 || destRefs[spec.childIdDest] != 1)
+      continue;
+
+    // O_CLOEXEC keeps the wire out of the children other than the two it connects
+    if (::pipe2(spec.wire, O_CLOEXEC) < 0)
+    {
+      spec.wire[0] = spec.wire[1] = -1;
+      continue;
     }
   }
-
-  return n;
 }
 
-// closePipesToChild()
+// wireEndOf()
 // -----------------------------
-void Xtee::closePipesToChild(ChildStub &child)
+//@return the end of wire that the child should take as its stdXX, -1 if the stdXX is not wired
+int Xtee::wireEndOf(int childId, int childFd)
 {
-  std::string batch;
-  bool hasFeedToStdin = (_fd2src.end() != _fd2src.find(STDIN_FILENO));
-
-  if (CHILDIN(child) > STDERR_FILENO)
-    batch += closeDestFd(CHILDIN(child)) + ","; // STDIN of the chhild
-
-  if (CHILDOUT(child) > STDERR_FILENO)
-    batch += closeSrcFd(CHILDOUT(child)) + ","; // STDOUT of the chhild
+  for (size_t i = 0; i < _links.size(); i++)
+  {
+    LinkSpec &spec = _links[i];
+    if (spec.wire[0] < 0)
+      continue;
 
-  if (CHILDERR(child) > STDERR_FILENO)
-    batch += closeSrcFd(CHILDERR(child)); // STDERR of the chhild
+    if (STDIN_FILENO == childFd && spec.childIdDest == childId)
+      return spec.wire[0];
 
-  if (_childsToStdin >0 && hasFeedToStdin && (_fd2src.end() == _fd2src.find(STDIN_FILENO))) // this is the last child who feeds xtee stdin
-  {
-    int tmp =STDIN_FILENO;
-    batch += std::string(",") +closeSrcFd(tmp);
+    if (STDIN_FILENO != childFd && spec.childIdSrc == childId && spec.childFdSrc == childFd)
+      return spec.wire[1];
   }
 
-  errlog(LOGF_TRACE, "closed link(s) of CH%02d[%s]: %s", child.idx, child.cmd, batch.c_str());
-  // printLinks();
+  return -1;
 }
 
 // run()
 // -----------------------------
 int Xtee::run()
 {
+  if (_options.chunkSize > 0)
+    return runChunks();
+
+  // pa step 0. parse the links ahead of spawning, so that the 1:1 links can be wired
+  // between the children instead of being relayed by xtee
+  for (size_t i = 0; i < _fdLinks.size(); i++)
+  {
+    LinkSpec spec;
+    if (parseLink(_fdLinks[i], spec))
+      _links.push_back(spec);
+  }
+
+  wireLinks();
+  planPlacements();
+
   for (size_t i = 0; i < _childCommands.size(); i++)
   {
     char *childcmd = _childCommands[i];
 
-    // pa step 1. init pipe pairs
+    // an in-process endpoint takes the place of a child with no process to spawn
+    Endpoints::iterator itEndpoint = _endpoints.find(i + 1);
+    if (_endpoints.end() != itEndpoint)
+    {
+      ChildStub child;
+      memset(&child, 0, sizeof(child));
+      child.idx = i + 1;
+      child.cmd = childcmd;
+      child.pidfd = -1;
+      child.endpoint = itEndpoint->second;
+      CHILDIN(child)  = reserveFd(child.endpoint, FDF_SINK);
+      CHILDOUT(child) = reserveFd(child.endpoint, FDF_SOURCE);
+      CHILDERR(child) = -1;
+      _children.push_back(child);
+      errlog(LOGF_TRACE, "created CH%02u as endpoint [%d>IN,%d<OUT]: %s", child.idx, CHILDIN(child), CHILDOUT(child), child.cmd);
+      continue;
+    }
+
+    // pa step 1. init pipe pairs, a wired stdXX takes the end of the wire instead
     StdioPipes stdioPipes;
     memset(&stdioPipes, -1, sizeof(stdioPipes));
-    ::pipe(PSTDIN(stdioPipes));
-    ::pipe(PSTDOUT(stdioPipes));
-    ::pipe(PSTDERR(stdioPipes));
+    if ((PSTDIN(stdioPipes)[0] = wireEndOf(i + 1, STDIN_FILENO)) < 0)
+      ::pipe(PSTDIN(stdioPipes));
+    if ((PSTDOUT(stdioPipes)[1] = wireEndOf(i + 1, STDOUT_FILENO)) < 0)
+      ::pipe(PSTDOUT(stdioPipes));
+    if ((PSTDERR(stdioPipes)[1] = wireEndOf(i + 1, STDERR_FILENO)) < 0)
+      ::pipe(PSTDERR(stdioPipes));
 
     // pa step 2. create child process that is a clone of the parent
     pid_t pidChild = fork();
@@ -328,6 +2027,7 @@ int Xtee::run()
       }
 
       _children.clear();
+      applyPlacement(i + 1);
 
       // child step 2. prepare the child command line
       char *childargv[32];
@@ -358,8 +2058,12 @@ int Xtee::run()
     child.idx = i + 1;
     child.cmd = childcmd;
     child.pid = pidChild;
+    child.pidfd = syscall(SYS_pidfd_open, pidChild, 0);
     child.status = 0;
-    // file descriptor unused in parent
+    memset(&child.rusage, 0, sizeof(child.rusage));
+    memset(&child.sample, 0, sizeof(child.sample));
+    child.endpoint = NULL;
+    // file descriptor unused in parent, so are the wire ends that the child has taken
     CHILDIN(child) = CHILDOUT(child) = CHILDERR(child) = -1;
     ::close(PSTDIN(stdioPipes)[0]);
     CHILDIN(child)  = PSTDIN(stdioPipes)[1];
@@ -371,6 +2075,10 @@ int Xtee::run()
     // for (int j = 0; j < 3; j++)
     //   ::fcntl(child.stdio[j], F_SETFL, O_NONBLOCK);
 
+    trackPipe(CHILDIN(child));
+    trackPipe(CHILDOUT(child));
+    trackPipe(CHILDERR(child));
+
     _children.push_back(child);
     errlog(LOGF_TRACE, "created CH%02u pid(%d) [%d>IN(%d),%d<OUT(%d),%d<ERR(%d)]: %s", child.idx, child.pid,
            CHILDIN(child), PSTDIN(stdioPipes)[0], CHILDOUT(child), PSTDOUT(stdioPipes)[1], CHILDERR(child), PSTDERR(stdioPipes)[1],
@@ -379,42 +2087,13 @@ int Xtee::run()
 
   // pa step 4. build up the link exchanges
   errlog(LOGF_TRACE, "created %u child(s), making up the links", _children.size());
-  for (size_t i = 0; i < _fdLinks.size(); i++)
+  for (size_t i = 0; i < _links.size(); i++)
   {
-    char *dest = strtok(_fdLinks[i], ":"), *src = strtok(0, ":"); // char *delimitor = strchr(_fdLinks[i], ':'); // strchr(_fdLinks[i].c_str(), ':');
-    if (NULL == dest || NULL == src)
-      continue;
-
-    int childIdDest = 0, childFdDest = -1, childIdSrc = 0, childFdSrc = -1;
-    char *strChildId = strtok(dest, ".");
-    char *strfd = strtok(0, ".");
-    if (NULL != strfd)
-    {
-      childFdDest = atoi(strfd);
-      childIdDest = atoi(strChildId);
-    }
-    else
-    {
-      childIdDest = atoi(strChildId);
-      childFdDest = 0;
-    }
-
-    strChildId = strtok(src, ".");
-    strfd = strtok(0, ".");
-    if (NULL != strfd)
-    {
-      childFdSrc = atoi(strfd);
-      childIdSrc = atoi(strChildId);
-    }
-    else
-    {
-      childIdSrc = 0;
-      childFdSrc = atoi(strChildId);
-    }
-
-    if (childIdDest > (int)_children.size() || childIdSrc > (int)_children.size() || STDIN_FILENO != childFdDest || (childFdSrc != STDOUT_FILENO && childFdSrc != STDERR_FILENO))
+    LinkSpec &spec = _links[i];
+    int childIdDest = spec.childIdDest, childFdDest = spec.childFdDest, childIdSrc = spec.childIdSrc, childFdSrc = spec.childFdSrc;
+    if (spec.wire[0] >= 0)
     {
-      errlog(LOGF_ERROR, "skip invalid link CH%02d:%d<-CH%02d:%d", childIdDest, childFdDest, childIdSrc, childFdSrc);
+      errlog(LOGF_TRACE, "wired CH%02d.%d<-CH%02d.%d directly", childIdDest, childFdDest, childIdSrc, childFdSrc);
       continue;
     }
 
@@ -426,14 +2105,14 @@ int Xtee::run()
       ChildStub &child = _children[childIdSrc - 1];
       // FDSet &fwdset = (childFdSrc == STDOUT_FILENO) ? child.fwdStdout : child.fwdStderr;
       // fwdset.insert(destPipe);
-      link((childFdSrc == STDOUT_FILENO)?CHILDOUT(child):CHILDERR(child), destPipe);
+      link((childFdSrc == STDOUT_FILENO)?CHILDOUT(child):CHILDERR(child), destPipe, &spec.opts);
 
       if (STDIN_FILENO == destPipe)
         _childsToStdin++; // child ever asked to output to parenet's stdin
     }
     else if (childFdSrc == STDOUT_FILENO)
       // _stdin2fwd.insert(destPipe);
-      link(STDIN_FILENO, destPipe);
+      link(STDIN_FILENO, destPipe, &spec.opts);
     else continue;
 
     errlog(LOGF_TRACE, "linked %d:CH%02d.%d<-%d:CH%02d.%d", destPipe, childIdDest, childFdDest, srcPipe, childIdSrc, childFdSrc);
@@ -453,95 +2132,125 @@ int Xtee::run()
     //   errlog(LOGF_TRACE, "linked orphan %d:CH%02d.IN<-PA.IN", CHILDIN(child), i+1);
     // }
 
-    if (_fd2fwd.end() == _fd2fwd.find(CHILDOUT(child)))
+    if (CHILDOUT(child) >= 0 && _fd2fwd.end() == _fd2fwd.find(CHILDOUT(child)))
     {
-      link(CHILDOUT(child), STDOUT_FILENO);
+      LinkOpts opts;
+      initLinkOpts(opts);
+      opts.relay = opts.records = _options.recordFanIn;
+      link(CHILDOUT(child), STDOUT_FILENO, &opts);
       errlog(LOGF_TRACE, "linked orphan %d:CH%02d.OUT->PA.OUT", CHILDOUT(child), i+1);
     }
 
-    if (_fd2fwd.end() == _fd2fwd.find(CHILDERR(child)))
+    if (CHILDERR(child) >= 0 && _fd2fwd.end() == _fd2fwd.find(CHILDERR(child)))
     {
       link(CHILDERR(child), STDERR_FILENO);
       errlog(LOGF_TRACE, "linked orphan %d:CH%02d.ERR->PA.ERR", CHILDERR(child), i+1);
     }
   }
 
-  // scan and compress the linkages
-  // for (FDIndex::iterator it = _fd2fwd.begin(); it != _fd2fwd.end(); it++)
-  // {
-  //   if (it->second.size() != 1)
-  //     continue;
+  printLinks();
 
-  //   int dest = (*it->second.begin());
-  //   if (dest > STDERR_FILENO)
-  //   {
-  //     ::dup2(it->first, dest);
-  //     src2del.push_back(it->first);
-  //     ::close(it->first);
-  //     // NOT GOOD
-  //   }
-  // }
+  // pinned after spawning, so that the children don't inherit the placement of xtee.
+  // The relay buffer is mapped only then, and the first touch allocates its pages on
+  // the node that xtee runs on
+  applyPlacement(0);
+  if (NULL == _relayBuf)
+  {
+    void *mem = ::mmap(NULL, READ_SIZE_MAX, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mem)
+    {
+      errlog(LOGF_ERROR, "failed to map the relay buffer: %s(%d)", strerror(errno), errno);
+      return -100;
+    }
 
-  printLinks();
+    memset(mem, 0, READ_SIZE_MAX);
+    _relayBuf = (char *)mem;
+  }
 
   // pa step 5. start the main loop
-  int maxTimeouts = _options.secsTimeout * QoS_MEASURES_PER_SEC;
-  bool bChildCheckNeeded = false;
-  int nIdles = 0;
+  bool bChildCheckNeeded = true;
   int cLiveChildren =0;
+  std::vector<FDPair> polledSrcs; // the endpoints as sources and their pollFds
+
+  _stampActivity = now();
+  if (_options.secsTimeout > 0)
+    setTimer(TIMER_IDLE, _stampActivity + _options.secsTimeout *1000);
 
-  for (int timeouts = 0; !_bQuit && (maxTimeouts < 0 || timeouts < maxTimeouts);)
+  if (_stampStart > 0 && _options.secsDuration > 0)
+    setTimer(TIMER_DURATION, _stampStart + _options.secsDuration *1000);
+
+  if (_options.msecProfile > 0)
+    profileChildren(_stampProfileStart = _stampActivity);
+
+  while (!_bQuit)
   {
-    // pa step 5.1 check the child processes
-    if (bChildCheckNeeded || nIdles > (QoS_MEASURES_PER_SEC *10)) // up to 10sec interval to check child process
+    // pa step 5.1 check the child processes, only those without a pidfd have to be polled
+    if (bChildCheckNeeded)
     {
       cLiveChildren =0;
-      nIdles = 0;
+      bChildCheckNeeded = false;
+      bool bPolling = false;
       for (size_t j = 0; !_bQuit && j < _children.size(); j++)
       {
         ChildStub &child = _children[j];
-        if (child.pid <=0)
-          continue;
-
-        pid_t wpid = waitpid(child.pid, &child.status, WNOHANG | WUNTRACED); // instantly return
-        if (0 == wpid) // WNOHANG returns 0 when child is still running
-        {
+        if (child.pid > 0 && (child.pidfd >= 0 || !reapChild(child)))
           cLiveChildren++;
-          continue;
-        }
-
-        closePipesToChild(child);
-        if (wpid == child.pid)
-          errlog(LOGF_TRACE, "detected CH%02u pid(%d) exited w/ status(0x%x): %s", child.idx, child.pid, child.status, child.cmd);
-        else
-          errlog(LOGF_TRACE, "detected CH%02u pid(%d) gone: %s", child.idx, child.pid, child.cmd);
 
-        child.pid = -1;
+        bPolling = bPolling || (child.pid > 0 && child.pidfd < 0);
       }
+
+      if (bPolling)
+        setTimer(TIMER_POLL, now() + CHILD_POLL_INTERVAL_MSEC);
     }
 
-    // pa step 5.2 prepare fdset for select()
+    // pa step 5.2 prepare fdset for select(), the feeds of stdin are left out while
+    // yielding to the rate limit
     int bytesChildrenIO = 0;
 
     FD_ZERO(&_fdsetRead);
     FD_ZERO(&_fdsetErr);
 
-    FD_SET(STDIN_FILENO, &_fdsetRead);
-    FD_SET(STDIN_FILENO, &_fdsetErr);
-    int maxfd = STDIN_FILENO;
+    FDIndex::iterator itFeeds = _fd2src.find(STDIN_FILENO);
+    const FDSet *pausedFeeds = (_stampStdinResume > 0 && _fd2src.end() != itFeeds) ? &itFeeds->second : NULL;
+    if (!_bStdinEOF && _stampStdinResume <= 0)
+      FD_SET(STDIN_FILENO, &_fdsetRead);
+
+    if (!_bStdinEOF)
+      FD_SET(STDIN_FILENO, &_fdsetErr);
+    int maxfd = STDIN_FILENO, maxSrcFd = STDIN_FILENO;
+    bool bPollEveryRound = false, bPollIdle = false;
+    polledSrcs.clear();
     for (FDIndex::iterator it = _fd2fwd.begin(); it != _fd2fwd.end(); it++)
     {
       if (it->first < 0)
         continue;
 
+      maxSrcFd = MAX(maxSrcFd, it->first);
+      if (NULL != pausedFeeds && pausedFeeds->end() != pausedFeeds->find(it->first))
+        continue;
+
+      // an endpoint is watched thru its pollFd, and is marked ready on behalf of it
+      Endpoint *endpoint = endpointOf(it->first);
+      if (NULL != endpoint)
+      {
+        int fdPoll = endpoint->pollFd();
+        polledSrcs.push_back(FDPair(it->first, fdPoll));
+        if (fdPoll < 0 && (_fdFlags[it->first] & FDF_IDLE))
+          bPollIdle = true;
+        else if (fdPoll < 0)
+          bPollEveryRound = true;
+        SET_VALID_FD_IN(fdPoll, _fdsetRead, maxfd);
+        continue;
+      }
+
       FD_SET(it->first, &_fdsetRead);
       FD_SET(it->first, &_fdsetErr);
       if (maxfd < it->first)
         maxfd = it->first;
     }
 
-    // errlog(LOGF_TRACE, "loop maxfd[%d] %d/%d live child(s)", maxfd, cLiveChildren,_children.size());
-    if (maxfd <= STDIN_FILENO) // || cLiveChildren > 0)
+    // errlog(LOGF_TRACE, "loop maxfd[%d] %d/%d live child(s)", maxSrcFd, cLiveChildren,_children.size());
+    if (maxSrcFd <= STDIN_FILENO) // || cLiveChildren > 0)
     {
       // no child seems alive, quit
       errlog(LOGF_TRACE, "stopping as no more alive child");
@@ -549,64 +2258,126 @@ int Xtee::run()
       break;
     }
 
-    // pa step 5.3 do select()
-    struct timeval timeout;
-    timeout.tv_sec = QoS_MEASURE_INTERVAL_MSEC / 1000;
-    timeout.tv_usec = (QoS_MEASURE_INTERVAL_MSEC % 1000) * 1000;
-
-    int rc = select(maxfd + 1, &_fdsetRead, NULL, &_fdsetErr, &timeout);
+    for (FDBuffers::iterator it = _tapRequests.begin(); it != _tapRequests.end(); it++)
+      SET_VALID_FD_IN(it->first, _fdsetRead, maxfd);
+    SET_VALID_FD_IN(_fdTapListener, _fdsetRead, maxfd);
+    for (size_t i = 0; i < _children.size(); i++)
+      SET_VALID_FD_IN(_children[i].pidfd, _fdsetRead, maxfd);
+    SET_VALID_FD_IN(_fdTimer, _fdsetRead, maxfd);
+
+    // pa step 5.3 do select(), no timeout as the timerfd wakes it up for the deadlines,
+    // unless an endpoint without a pollFd has to be called: at once while it produces,
+    // or after the aging interval once it has had nothing, rather than spinning on it
+    struct timeval noWait = {0, 0}, idleWait = {0, ENDPOINT_IDLE_MSEC * 1000};
+    int rc = select(maxfd + 1, &_fdsetRead, NULL, &_fdsetErr, bPollEveryRound ? &noWait : (bPollIdle ? &idleWait : NULL));
     if (_bQuit)
       break;
 
+    for (size_t i = 0; rc >= 0 && i < polledSrcs.size(); i++)
+    {
+      if (polledSrcs[i].second < 0 || FD_ISSET(polledSrcs[i].second, &_fdsetRead))
+        FD_SET(polledSrcs[i].first, &_fdsetRead);
+    }
+
     // pa step 5.4  select() dispatching
     if (rc < 0) // select() err, quit
     {
       errlog(LOGF_ERROR, "quitting due to io err(%d): %s(%d)", rc, strerror(errno), errno);
       break;
     }
-    else if (0 == rc) // timeout
-    {
-      timeouts++;
-      bChildCheckNeeded = true;
+    else if (0 == rc && !bPollEveryRound && !bPollIdle)
       continue;
-    }
 
-    // pa step 5.5 about this stdin
-    if (IS_VALID_FLAG_SET(STDIN_FILENO, _fdsetRead))
+    if (IS_VALID_FLAG_SET(_fdTimer, _fdsetRead))
     {
-      int n= ::read(STDIN_FILENO, buf, sizeof(buf));
-      if (n < 0 ) // && _childsToStdin<=0) // EOF at stdin
-        _bQuit = true;
-      else stdinQoS(buf, n);
+      if (onTimers() & (1 << TIMER_POLL))
+        bChildCheckNeeded = true;
+
+      if (_bQuit)
+        break;
     }
 
     if (_childsToStdin<=0 && IS_VALID_FLAG_SET(STDIN_FILENO, _fdsetErr))
       _bQuit = true;
 
-    // pa step 5.6 scan if any child has IO occured
-    for (size_t i = 0; !_bQuit && i < _children.size(); i++)
+    // the ready sources are served class by class, the higher priority is read and
+    // written ahead of the lower, which may be deferred to the next rounds
+    unsigned roundPrios = schedulePriorities();
+    for (int prio = 0; !_bQuit && prio < LINK_PRIO_CLASSES; prio++)
     {
-      ChildStub &child = _children[i];
-      ssize_t n = 0;
+      if (0 == (roundPrios & (1 << prio)))
+        continue;
+
+      // pa step 5.5 about this stdin
+      if (prio == prioOf(STDIN_FILENO) && IS_VALID_FLAG_SET(STDIN_FILENO, _fdsetRead))
+      {
+        // the rate limit keeps the small reads that it paces by
+        FlowStub &flow = flowOf(STDIN_FILENO);
+        int n= ::read(STDIN_FILENO, _relayBuf, (_kBpsLimit > 0) ? READ_SIZE_MIN : flow.readSize);
+        if (n >= flow.readSize && flow.readSize < READ_SIZE_MAX)
+          flow.readSize <<= 1;
+
+        if (n < 0 ) // && _childsToStdin<=0) // EOF at stdin
+          _bQuit = true;
+        else if (0 == n)
+          closeStdin();
+        else stdinQoS(_relayBuf, n);
+
+        if (n > 0)
+          bytesChildrenIO += n;
+      }
 
-      // about the child's stdout
-      n = checkAndForward(CHILDOUT(child), STDOUT_FILENO, child.idx);
+      // pa step 5.6 scan if any child of the class has IO occured
+      for (size_t i = 0; !_bQuit && i < _children.size(); i++)
+      {
+        ChildStub &child = _children[i];
+        ssize_t n = 0;
 
-      if (n < 0)
-        bChildCheckNeeded = true;
-      else
-        bytesChildrenIO += n;
+        // about the child's stdout
+        if (prio == prioOf(CHILDOUT(child)))
+        {
+          n = checkAndForward(CHILDOUT(child), STDOUT_FILENO, child.idx);
+          if (n < 0)
+            bChildCheckNeeded = true;
+          else
+            bytesChildrenIO += n;
+        }
 
-      // about the child's stderr
-      n = checkAndForward(CHILDERR(child), STDERR_FILENO, child.idx);
-      if (n < 0)
-        bChildCheckNeeded = true;
-      else
-        bytesChildrenIO += n;
+        // about the child's stderr
+        if (prio == prioOf(CHILDERR(child)))
+        {
+          n = checkAndForward(CHILDERR(child), STDERR_FILENO, child.idx);
+          if (n < 0)
+            bChildCheckNeeded = true;
+          else
+            bytesChildrenIO += n;
+        }
+      }
+    }
+
+    drainFanIns();
+
+    // pa step 5.7 reap the children whose pidfd tells they have exited
+    for (size_t i = 0; i < _children.size(); i++)
+    {
+      if (IS_VALID_FLAG_SET(_children[i].pidfd, _fdsetRead))
+        reapChild(_children[i]);
+    }
+
+    if (bytesChildrenIO > 0)
+      _stampActivity = now();
+
+    // pa step 5.8 serve the tap socket
+    closeGoneTaps();
+    for (FDBuffers::iterator it = _tapRequests.begin(); it != _tapRequests.end();)
+    {
+      int fd = (it++)->first;
+      if (IS_VALID_FLAG_SET(fd, _fdsetRead))
+        readTapRequest(fd);
     }
 
-    if (bytesChildrenIO <= 0)
-      nIdles++;
+    if (IS_VALID_FLAG_SET(_fdTapListener, _fdsetRead))
+      acceptTaps();
 
   } // end of select() loop
 
@@ -615,17 +2386,65 @@ int Xtee::run()
   for (size_t i = 0; i < _children.size(); i++)
     closePipesToChild(_children[i]);
 
+  for (TapIndex::iterator it = _taps.begin(); it != _taps.end(); it++)
+    _tapsGone.insert(it->first);
+  closeGoneTaps();
+
+  for (FDBuffers::iterator it = _tapRequests.begin(); it != _tapRequests.end(); it++)
+    ::close(it->first);
+  _tapRequests.clear();
+
+  if (_fdTapListener >= 0)
+  {
+    ::close(_fdTapListener);
+
+    // the path may have been taken over by another since, which is left alone
+    struct stat st;
+    if (0 == ::lstat(_options.tapSocket, &st) && S_ISSOCK(st.st_mode) && st.st_dev == _statTapSocket.st_dev && st.st_ino == _statTapSocket.st_ino)
+      ::unlink(_options.tapSocket);
+    _fdTapListener = -1;
+  }
+
+  if (_fdTimer >= 0)
+  {
+    ::close(_fdTimer);
+    _fdTimer = -1;
+  }
+
   ::fsync(STDOUT_FILENO);
   ::fsync(STDERR_FILENO);
 
   return 0;
 }
 
-bool Xtee::link(int fdIn, int fdTo)
+bool Xtee::link(int fdIn, int fdTo, const LinkOpts* opts)
 {
   if (fdIn < 0 || fdTo < 0)
     return false;
 
+  dropHop(fdIn, fdTo);
+  if (NULL != opts && opts->relay)
+  {
+    HopStub &hop = _hops[FDPair(fdIn, fdTo)];
+    hop.fdSrc = fdIn;
+    hop.fdDest = fdTo;
+    hop.opts = *opts;
+    hop.complete = 0;
+    hop.deficit = 0;
+    hop.seen = 0;
+    hop.stampKept = 0;
+    hop.rand = (uint32_t)(now() ^ (fdIn << 16) ^ fdTo) | 1;
+    hop.xfFailed = false;
+    hop.xfState = NULL;
+    hop.stampCoalesceDue = 0;
+    if (NULL != hop.opts.xf)
+      hop.xfState = (hop.opts.xf->flags & XTEE_XF_STATELESS) ? hop.opts.xfShared : (NULL != hop.opts.xf->open ? hop.opts.xf->open(hop.opts.xfArg) : NULL);
+
+    // a weighted or high-priority source takes multiple reads a round, which must not block
+    if (((hop.opts.records && hop.opts.weight > 1) || 0 == hop.opts.prio) && fdIn > STDERR_FILENO)
+      ::fcntl(fdIn, F_SETFL, ::fcntl(fdIn, F_GETFL) | O_NONBLOCK);
+  }
+
   FDIndex::iterator itIdx = _fd2fwd.find(fdIn);
   if (_fd2fwd.end() == itIdx)
   {
@@ -643,6 +2462,7 @@ bool Xtee::link(int fdIn, int fdTo)
   }
 
   itIdx->second.insert(fdIn);
+  _routesDirty = true;
   return true;
 }
 
@@ -654,6 +2474,340 @@ void Xtee::unlink(int fdIn, int fdTo)
 
   if (_fd2src.end() != (itIdx = _fd2src.find(fdTo)))
     itIdx->second.erase(fdIn);
+
+  dropHop(fdIn, fdTo);
+  _routesDirty = true;
+}
+
+// compileRoutes()
+// -----------------------------
+void Xtee::compileRoutes()
+{
+  uint32_t gen = _routeGen.load(std::memory_order_relaxed) + 1;
+  RouteTable &table = _routeTables[gen & 1];
+
+  int maxfd = _fd2fwd.empty() ? -1 : _fd2fwd.rbegin()->first;
+  table.routes.assign(maxfd + 1, Route());
+  table.spill.clear();
+  table.hops.clear();
+  for (int fd = 0; fd <= maxfd; fd++)
+  {
+    table.routes[fd].ndests = -1;
+    table.routes[fd].hops = -1;
+  }
+
+  for (FDIndex::iterator it = _fd2fwd.begin(); it != _fd2fwd.end(); it++)
+  {
+    if (it->first < 0)
+      continue;
+
+    Route &route = table.routes[it->first];
+    int *dests = route.dests;
+    route.ndests = 0;
+    route.reads = 1;
+    route.prio = LINK_PRIO_DEFAULT;
+    if (it->second.size() > ROUTE_INLINE_DESTS)
+    {
+      route.spill = table.spill.size();
+      table.spill.resize(route.spill + it->second.size());
+      dests = &table.spill[route.spill];
+    }
+
+    for (FDSet::iterator itDest = it->second.begin(); itDest != it->second.end(); itDest++)
+    {
+      if (*itDest >= 0)
+        dests[route.ndests++] = *itDest;
+    }
+
+    // the hops are by the same order of dests, and only listed if any has options
+    HopIndex::iterator itHop = _hops.lower_bound(FDPair(it->first, INT_MIN));
+    if (_hops.end() == itHop || itHop->first.first != it->first)
+      continue;
+
+    route.hops = table.hops.size();
+    route.prio = LINK_PRIO_CLASSES;
+    for (int i = 0; i < route.ndests; i++)
+    {
+      HopStub *hop = hopOf(it->first, dests[i]);
+      table.hops.push_back(hop);
+      route.prio = MIN(route.prio, (NULL != hop) ? hop->opts.prio : LINK_PRIO_DEFAULT);
+      if (NULL != hop && hop->opts.records && route.reads < hop->opts.weight)
+        route.reads = hop->opts.weight;
+    }
+
+    if (0 == route.prio && it->first > STDERR_FILENO)
+      route.reads = MAX(route.reads, LINK_PRIO_DRAIN_READS);
+  }
+
+  _routesDirty = false;
+  _routeGen.store(gen, std::memory_order_release);
+}
+
+// routeOf()
+// -----------------------------
+//@return false if the fd is not a source, where the view has no destination but a read
+inline bool Xtee::routeOf(int fdSrc, RouteView& view)
+{
+  if (_routesDirty)
+    compileRoutes();
+
+  const RouteTable &table = _routeTables[_routeGen.load(std::memory_order_acquire) & 1];
+  view.ndests = 0;
+  view.reads = 1;
+  view.prio = LINK_PRIO_DEFAULT;
+  view.dests = NULL;
+  view.hops = NULL;
+  if (fdSrc < 0 || fdSrc >= (int)table.routes.size() || table.routes[fdSrc].ndests < 0)
+    return false;
+
+  const Route &route = table.routes[fdSrc];
+  view.ndests = route.ndests;
+  view.reads = route.reads;
+  view.prio = route.prio;
+  view.dests = (route.ndests > ROUTE_INLINE_DESTS) ? &table.spill[route.spill] : route.dests;
+  if (route.hops >= 0)
+    view.hops = &table.hops[route.hops];
+
+  return true;
+}
+
+int Xtee::prioOf(int fdSrc)
+{
+  RouteView route;
+  routeOf(fdSrc, route);
+  return route.prio;
+}
+
+// schedulePriorities()
+// -----------------------------
+// strict priority with aging among the sources that select() found ready: only
+// those of the highest class present are served this round, unless a lower one
+// has been deferred for longer than msecAging. The deferred are cleared from
+// _fdsetRead
+//@return the bitmask of the priority classes to serve this round
+unsigned Xtee::schedulePriorities()
+{
+  int top = LINK_PRIO_CLASSES;
+  bool stdinReady = IS_VALID_FLAG_SET(STDIN_FILENO, _fdsetRead);
+  if (stdinReady)
+    top = prioOf(STDIN_FILENO);
+
+  for (FDIndex::iterator it = _fd2fwd.begin(); it != _fd2fwd.end(); it++)
+  {
+    if (IS_VALID_FLAG_SET(it->first, _fdsetRead))
+      top = MIN(top, prioOf(it->first));
+  }
+
+  unsigned prios = 0;
+  int64_t stampNow = now();
+  if (stdinReady && _fd2fwd.end() == _fd2fwd.find(STDIN_FILENO))
+    admitReady(STDIN_FILENO, top, stampNow, prios);
+
+  for (FDIndex::iterator it = _fd2fwd.begin(); it != _fd2fwd.end(); it++)
+  {
+    if (IS_VALID_FLAG_SET(it->first, _fdsetRead))
+      admitReady(it->first, top, stampNow, prios);
+  }
+
+  return prios;
+}
+
+void Xtee::admitReady(int fd, int top, int64_t stampNow, unsigned& prios)
+{
+  if (fd >= (int)_fdWaitSince.size())
+    _fdWaitSince.resize(fd + 1, 0);
+
+  int prio = prioOf(fd);
+  int64_t &since = _fdWaitSince[fd];
+  if (prio <= top || (since > 0 && stampNow - since >= _options.msecAging))
+  {
+    since = 0;
+    prios |= (1 << prio);
+    return;
+  }
+
+  if (since <= 0)
+    since = stampNow;
+  FD_CLR(fd, &_fdsetRead);
+}
+
+void Xtee::setFdFlags(int fd, uint8_t flags)
+{
+  if (fd < 0)
+    return;
+
+  if (fd >= (int)_fdFlags.size())
+    _fdFlags.resize(fd + 1, 0);
+
+  _fdFlags[fd] = flags;
+}
+
+// flowOf()
+// -----------------------------
+Xtee::FlowStub& Xtee::flowOf(int fd)
+{
+  if (fd < 0)
+  {
+    memset(&_flowNone, 0, sizeof(_flowNone));
+    _flowNone.readSize = READ_SIZE_MIN;
+    return _flowNone;
+  }
+
+  if (fd >= (int)_fdFlows.size())
+  {
+    FlowStub flow;
+    memset(&flow, 0, sizeof(flow));
+    _fdFlows.resize(fd + 1, flow);
+  }
+
+  if (_fdFlows[fd].readSize <= 0)
+    _fdFlows[fd].readSize = READ_SIZE_MIN;
+  return _fdFlows[fd];
+}
+
+// trackPipe()
+// -----------------------------
+// takes the pipe of a child into the adapting, which starts at the capacity the kernel gave
+void Xtee::trackPipe(int fd)
+{
+  if (fd <= STDERR_FILENO)
+    return;
+
+  FlowStub &flow = flowOf(fd);
+  flow.bytes = flow.total = 0;
+  flow.readSize = READ_SIZE_MIN;
+  flow.pipeSize = MAX(::fcntl(fd, F_GETPIPE_SZ), 0);
+}
+
+// adaptPipes()
+// -----------------------------
+// sizes each linked pipe to hold PIPE_HOLD_MSEC of the throughput of the last period, and
+// each source to be read by as much. A pipe grows at once but shrinks by half each period, so
+// that a bursty link doesn't flap, and an idle one ends up at the minimum
+void Xtee::adaptPipes(int64_t stampNow)
+{
+  int64_t msec = (_stampAdapted > 0) ? MAX(stampNow - _stampAdapted, 1) : PIPE_ADAPT_MSEC;
+  _stampAdapted = stampNow;
+  bool busy = false;
+
+  for (int fd = 0; fd < (int)_fdFlows.size(); fd++)
+  {
+    FlowStub &flow = _fdFlows[fd];
+    bool isSrc = (_fd2fwd.end() != _fd2fwd.find(fd)), isDest = (_fd2src.end() != _fd2src.find(fd));
+    if (!isSrc && !isDest)
+      continue;
+
+    int64_t bps = flow.bytes * 1000 / msec;
+    int64_t want = READ_SIZE_MIN;
+    while (want < bps * PIPE_HOLD_MSEC / 1000 && want < (int64_t)_options.pipeMax)
+      want <<= 1;
+    flow.bytes = 0;
+
+    int readSize = flow.readSize;
+    if (isSrc)
+      flow.readSize = MIN(want, READ_SIZE_MAX);
+
+    int pipeSize = flow.pipeSize;
+    int64_t size = MIN(MAX(want, (int64_t)_options.pipeMin), (int64_t)_options.pipeMax);
+    if (pipeSize > 0 && size < pipeSize)
+      size = MAX(size, pipeSize / 2);
+
+    // shrinking fails as EBUSY if the pipe holds more than the new size, which retries the next period
+    if (pipeSize > 0 && size != pipeSize)
+    {
+      int rc = ::fcntl(fd, F_SETPIPE_SZ, (int)size);
+      if (rc > 0)
+        flow.pipeSize = rc;
+    }
+
+    busy = busy || bps > 0 || flow.pipeSize > _options.pipeMin;
+    if (flow.pipeSize == pipeSize && (flow.readSize == readSize || !isSrc))
+      continue;
+
+    int cmdNo = 0;
+    for (size_t i = 0; i < _children.size(); i++)
+    {
+      if (fd == CHILDIN(_children[i]) || fd == CHILDOUT(_children[i]) || fd == CHILDERR(_children[i]))
+        cmdNo = _children[i].idx;
+    }
+
+    errlog(LOGF_TRACE, "CH%02u fd(%d) at %.2fMB/s: pipe %dKB->%dKB, read %dKB->%dKB", cmdNo, fd, bps / 1e6,
+           pipeSize >> 10, flow.pipeSize >> 10, readSize >> 10, isSrc ? (flow.readSize >> 10) : (readSize >> 10));
+  }
+
+  // the adapting carries on while any link is busy or any pipe has to shrink back
+  if (busy)
+    setTimer(TIMER_ADAPT, stampNow + PIPE_ADAPT_MSEC);
+  else
+    _stampAdapted = 0;
+}
+
+// reserveFd()
+// -----------------------------
+//@return a reserved fd that stands for a side of the endpoint in the links
+int Xtee::reserveFd(Endpoint* endpoint, uint8_t flags)
+{
+  int fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    errlog(LOGF_ERROR, "failed to reserve fd for endpoint: %s(%d)", strerror(errno), errno);
+    return -1;
+  }
+
+  setFdFlags(fd, flags);
+  if (fd >= (int)_fdEndpoints.size())
+    _fdEndpoints.resize(fd + 1, NULL);
+
+  _fdEndpoints[fd] = endpoint;
+  return fd;
+}
+
+// endpointOf()
+// -----------------------------
+//@return the endpoint that the fd is reserved for, NULL if it is a real fd
+Xtee::Endpoint* Xtee::endpointOf(int fd)
+{
+  if (fd < 0 || fd >= (int)_fdFlags.size() || 0 == (_fdFlags[fd] & (FDF_SOURCE | FDF_SINK)))
+    return NULL;
+
+  return _fdEndpoints[fd];
+}
+
+// readFrom()
+// -----------------------------
+// reads a source, an endpoint produces right into the buffer
+int Xtee::readFrom(int fd, char* buf, int size)
+{
+  if (fd < (int)_fdFlags.size() && (_fdFlags[fd] & FDF_SOURCE))
+  {
+    int n = _fdEndpoints[fd]->produce(buf, size);
+    _fdFlags[fd] = (n < 0) ? (_fdFlags[fd] | FDF_IDLE) : (_fdFlags[fd] & ~FDF_IDLE);
+    return n;
+  }
+
+  return ::read(fd, buf, size);
+}
+
+// releaseFd()
+// -----------------------------
+// closes an fd that is no more linked, the endpoint of a reserved fd is told of the end
+void Xtee::releaseFd(int fd)
+{
+  Endpoint *endpoint = endpointOf(fd);
+  if (NULL != endpoint)
+  {
+    bool sink = (0 != (_fdFlags[fd] & FDF_SINK));
+    setFdFlags(fd, 0);
+    _fdEndpoints[fd] = NULL;
+    if (sink)
+      endpoint->onEnd();
+  }
+  else
+    ::fsync(fd);
+
+  if (fd < (int)_fdFlows.size())
+    memset(&_fdFlows[fd], 0, sizeof(FlowStub));
+  ::close(fd);
 }
 
 static std::string fd2str(int fd)
@@ -670,7 +2824,28 @@ void Xtee::printLinks()
   {
     std::string to;
     for (FDSet::iterator itSet = it->second.begin(); itSet != it->second.end(); itSet++)
-      to += fd2str(*itSet)+ ",";
+    {
+      to += fd2str(*itSet);
+      HopStub *hop = hopOf(it->first, *itSet);
+      if (NULL != hop && hop->opts.records)
+        to += "(rec:w" + fd2str(hop->opts.weight) + ")";
+      if (NULL != hop && SAMPLE_NONE != hop->opts.sampleMode)
+      {
+        char sample[64];
+        if (SAMPLE_PERCENT == hop->opts.sampleMode)
+          snprintf(sample, sizeof(sample), "(sample:%.2f%%)", hop->opts.sampleArg * 100 / 4294967296.0);
+        else
+          snprintf(sample, sizeof(sample), (SAMPLE_NTH == hop->opts.sampleMode) ? "(sample:1/%llu)" : "(sample:%llums)", (unsigned long long)hop->opts.sampleArg);
+        to += sample;
+      }
+      if (NULL != hop && NULL != hop->opts.grep)
+        to += std::string("(grep:") + hop->opts.grep + ")";
+      if (NULL != hop && NULL != hop->opts.re)
+        to += std::string("(re:") + hop->opts.re + ")";
+      if (NULL != hop && NULL != hop->opts.xf)
+        to += std::string("(xf:") + hop->opts.xfPath + ")";
+      to += ",";
+    }
 
     if (!to.empty())
       to.erase(to.length() - 1); // erase the last comma
@@ -681,7 +2856,7 @@ void Xtee::printLinks()
   errlog(LOGF_TRACE, "links: %s", result.c_str());
 }
 
-std::string Xtee::_unlink(int fdBy, Xtee::FDIndex& lookup, Xtee::FDIndex& reverseLookup)
+std::string Xtee::_unlink(int fdBy, Xtee::FDIndex& lookup, Xtee::FDIndex& reverseLookup, bool bySrc)
 {
   std::string batch;
 
@@ -692,6 +2867,10 @@ std::string Xtee::_unlink(int fdBy, Xtee::FDIndex& lookup, Xtee::FDIndex& revers
   for (FDSet::iterator itInFound = itLookup->second.begin(); itInFound != itLookup->second.end(); itInFound++)
   {
     int fdLinked = *itInFound;
+    if (bySrc)
+      dropHop(fdBy, fdLinked);
+    else
+      dropHop(fdLinked, fdBy);
     FDIndex::iterator itReversed = reverseLookup.find(fdLinked);
     if (reverseLookup.end() == itReversed)
       continue; // not found
@@ -701,10 +2880,7 @@ std::string Xtee::_unlink(int fdBy, Xtee::FDIndex& lookup, Xtee::FDIndex& revers
     {
       // the fdLinked has no more links left, close it and clean
       if (fdLinked > STDERR_FILENO)
-      {
-        ::fsync(fdLinked);
-        ::close(fdLinked);
-      }
+        releaseFd(fdLinked);
 
       reverseLookup.erase(fdLinked);
       batch += fd2str(fdLinked) + ",";
@@ -720,12 +2896,13 @@ std::string Xtee::_unlink(int fdBy, Xtee::FDIndex& lookup, Xtee::FDIndex& revers
 
 std::string Xtee::closeSrcFd(int& fdSrc)
 {
-  std::string batch = fd2str(fdSrc) + "->[" + _unlink(fdSrc, _fd2fwd, _fd2src) +"]";
+  flushHopsFrom(fdSrc); // may compile the routes again, by emitting into stdin
+  std::string batch = fd2str(fdSrc) + "->[" + _unlink(fdSrc, _fd2fwd, _fd2src, true) +"]";
+  _routesDirty = true;
 
   if (fdSrc > STDERR_FILENO)
   {
-    ::fsync(fdSrc);
-    ::close(fdSrc);
+    releaseFd(fdSrc);
     fdSrc = -1;
   }
 
@@ -734,11 +2911,11 @@ std::string Xtee::closeSrcFd(int& fdSrc)
 
 std::string Xtee::closeDestFd(int& fdDest)
 {
-  std::string batch = fd2str(fdDest) + "<-[" + _unlink(fdDest, _fd2src, _fd2fwd) +"]";
+  _routesDirty = true;
+  std::string batch = fd2str(fdDest) + "<-[" + _unlink(fdDest, _fd2src, _fd2fwd, false) +"]";
   if (fdDest > STDERR_FILENO)
   {
-    ::fsync(fdDest);
-    ::close(fdDest);
+    releaseFd(fdDest);
     fdDest = -1;
   }
 
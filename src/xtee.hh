@@ -5,16 +5,38 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <atomic>
 
 extern "C"
 {
 #include <stdio.h>
 #include <stdlib.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <regex.h>
 }
 
+#include "xtee_plugin.h"
+
 #define EOL "\r\n"
 #define QoS_MEASURES_PER_SEC      (10)  // 10 times per second
 
+#define ROUTE_INLINE_DESTS        (12)  // keeps a Route within a 64-byte cache line
+#define FANIN_QUANTUM             (1024) // bytes of credit per weight that a fan-in source gains each DRR turn
+#define FANIN_RECORD_MAX          (64*1024) // a pending record longer than this is forwarded torn
+#define LINK_PRIO_CLASSES         (3)   // 0-high, 1-normal, 2-bulk
+#define LINK_PRIO_DEFAULT         (1)
+#define LINK_PRIO_DRAIN_READS     (16)  // reads a round to drain a high-priority source
+#define COALESCE_MSEC_DEFAULT     (2)   // the longest that coalesce=<bytes> holds the data by default
+#define COALESCE_BYTES_MAX        (1024*1024)
+#define PIPE_ADAPT_MSEC           (1000) // the period to resize the pipes and the reads by the throughput
+#define PIPE_HOLD_MSEC            (50)   // a pipe is sized to hold so long of the data that passes it
+#define PIPE_SIZE_MIN_DEFAULT     (64*1024) // the capacity that the kernel creates a pipe with
+#define READ_SIZE_MIN             (4*1024)
+#define READ_SIZE_MAX             (1024*1024)
+#define CHUNK_GATHER_MAX          (4*1024*1024) // the output held of a chunk that isn't the next to gather
+
 #define LOGF_TRACE (1 << 0)
 #define LOGF_ERROR (1 << 1)
 
@@ -38,11 +60,48 @@ public:
     int  secsToSkip;
     int  secsDuration;
     int  secsTimeout;
+    const char* tapSocket;
+    bool recordFanIn; // the orphan stdout of children fan in to xtee stdout by records
+    bool autoPlace;   // places each chain of producer->xtee->consumer on a NUMA node
+    int  msecAging;   // a ready source deferred by the higher priorities is served after this long
+    bool noStdin;     // leaves the stdin of the process alone, such as to the host that embeds xtee
+    long pipeMin;     // the bounds of the capacity that the pipes to the children adapt within,
+    long pipeMax;     // 0 as the max refers to /proc/sys/fs/pipe-max-size
+    int  msecProfile; // the interval to sample the resource usage of the children, 0 if not profiling
+    long chunkSize;   // -C, cuts stdin into chunks of so many bytes or lines, each to a run of -c, 0 if not chunked
+    bool chunkLines;  // chunkSize counts the lines instead of the bytes
+    int  chunkJobs;   // the chunks that run concurrently, 0 as the number of cpus
+    const char* chunkOutput; // the file of each chunk's output with {} for the index, NULL to gather on stdout in order
     unsigned int logflags;
   } Options;
 
+  // -----------------------------
+  // class Endpoint
+  // -----------------------------
+  // an in-process party that takes the place of a -c command, for a host program that
+  // embeds xtee. The source side produces right into the buffer of xtee, and the sink
+  // side is given a view of it, so the data crosses no pipe
+  class Endpoint
+  {
+  public:
+    virtual ~Endpoint() {}
+
+    // the fd that turns readable once the source has data, -1 to be called every round
+    // while it produces, and every few msec once it has had none at the moment
+    virtual int  pollFd() { return -1; }
+
+    //@return bytes produced into buf, 0 at the end of the source, -1 if none at the moment
+    virtual int  produce(char* buf, int size) { return 0; }
+
+    // takes the data linked to the endpoint, the view is valid only during the call
+    virtual void consume(const char* data, int len) {}
+
+    // no more data will be linked to the endpoint
+    virtual void onEnd() {}
+  };
+
   Xtee();
-  virtual ~Xtee() {}
+  virtual ~Xtee();
 
   bool init();
   int  run();
@@ -50,7 +109,14 @@ public:
   void stop() { _bQuit =true; }
 
   int pushCommand(char* cmd);
+
+  //@return the cmdNo of the input source of the files that the path or glob matches
+  int pushInput(const char* pattern);
+
+  //@return the cmdNo that refers to the endpoint in the links, in the same sequence as pushCommand()
+  int pushEndpoint(Endpoint* endpoint, const char* name = "@endpoint");
   int pushLink(char* link);
+  int pushPlacement(char* placement);
 
   int  errlog(unsigned short category, const char *fmt, ...);
   void printLinks();
@@ -63,6 +129,19 @@ protected:
   typedef std::set<int> FDSet;
   typedef std::map<int, FDSet> FDIndex;
 
+  // a sample of the resource usage of a child from /proc/<pid>/stat, status and io, with
+  // the bytes that passed its links, the counters are accumulated since the child started
+  typedef struct _ProcSample
+  {
+    int64_t stamp;
+    int64_t cpuTicks;   // utime + stime in clock ticks
+    int64_t rssKB;
+    int64_t rchar, wchar;           // the bytes thru read() and write() of any kind
+    int64_t readBytes, writeBytes;  // the bytes that the storage has been hit with
+    int64_t nvcsw, nivcsw;          // the voluntary and the involuntary context switches
+    int64_t linkIn, linkOut;        // the bytes xtee wrote to its stdin, and read from its stdout and stderr
+  } ProcSample;
+
   typedef struct _ChildStub
   {
     int  idx;
@@ -70,17 +149,208 @@ protected:
     int stdio[3];
     // FDSet fwdStdout, fwdStderr;
     int pid;
+    int pidfd;    // readable once the child exits, -1 if the kernel has no pidfd and the child is polled
     int status;
+    struct rusage rusage; // collected at reaping the child
+    Endpoint *endpoint;   // an in-process endpoint instead of a process, whose stdio are reserved fds
+    ProcSample sample;    // the last sample of profiling, stamp 0 if none yet
   } ChildStub;
 
   typedef std::vector<ChildStub> Children;
   Children _children;
   FDSet _stdin2fwd;
 
+  // the options of a link given in -l <TARGET>:<SOURCE>[,<opt>...]
+#define SAMPLE_NONE    (0)
+#define SAMPLE_NTH     (1) // every Nth record
+#define SAMPLE_PERCENT (2) // a random share of the records
+#define SAMPLE_MSEC    (3) // one record per interval
+  typedef struct _LinkOpts
+  {
+    bool relay;   // keeps xtee in the data path, implied by any other option
+    bool records; // forwards complete records only, fanning in with others by DRR
+    int  weight;  // the reads per round of the source, which weighs its share among the fan-in sources
+    int  prio;    // the priority class, 0 is the highest
+    int  sampleMode;    // SAMPLE_XXX, the records that the hop skips never reach the target
+    uint64_t sampleArg; // N of every Nth, the share out of 2^32, or the interval in msec
+    const char *grep;   // only the lines containing the substring are forwarded, NULL if no such filter
+    int  grepLen;
+    const char *re;     // only the lines matching the regex are forwarded, NULL if no such filter
+    regex_t *regex;     // compiled from re, kept for the lifetime of xtee
+    const char *xfPath; // the transform plugin that the data goes thru ahead of the filters, NULL if none
+    const char *xfArg;
+    const xtee_transform_t *xf;
+    void *xfShared;     // the instance of a stateless plugin that all its links share
+    void *xfLib;        // the handle that dlopen() gave the plugin
+    int  coalesceBytes; // the small writes are held till so many bytes, 0 if not coalesced
+    int  coalesceMsec;  // or till the first byte held is so old
+  } LinkOpts;
+
+  // a link parsed from -l <TARGET>:<SOURCE>
+  typedef struct _LinkSpec
+  {
+    int  childIdDest, childFdDest;
+    int  childIdSrc, childFdSrc;
+    LinkOpts opts;
+    Pipe wire; // the pipe handed from the source child directly to the target child, -1 if relayed by xtee.
+               // xtee closes the ends once the children have taken them, but keeps the values as a mark
+  } LinkSpec;
+
+  typedef std::vector<LinkSpec> LinkSpecs;
+  LinkSpecs _links;
+
+  // a tap is a consumer attached at runtime thru the tap socket, it receives
+  // a copy of its source from the moment of attaching
+  typedef struct _TapStub
+  {
+    int  fdSrc;
+    bool lossless; // false to drop the data if the tap can not take it instantly
+    int64_t bytes, drops;
+  } TapStub;
+  typedef std::map<int, TapStub> TapIndex;
+  typedef std::map<int, std::string> FDBuffers;
+
+  TapIndex  _taps;
+  FDBuffers _tapRequests; // accepted connections that have not yet named a source
+  FDSet     _tapsGone;
+  int       _fdTapListener;
+  char     *_relayBuf; // the relay buffer of READ_SIZE_MAX, mapped by run() once xtee is placed
+  struct stat _statTapSocket; // of the socket file that this run has bound, the only one to remove
+
   FDIndex _fd2fwd;
   FDIndex _fd2src;
 
-  bool    link(int fdIn, int fdTo);
+  // a hop is the per-link state of a source-to-destination link that has options
+  typedef struct _HopStub
+  {
+    int fdSrc, fdDest;
+    LinkOpts opts;
+
+    // fan-in of records
+    std::string pending; // data queued for fdDest, ends with an incomplete record
+    size_t complete;     // bytes of complete records at the head of pending
+    int    deficit;      // DRR deficit counter
+
+    // the selection of records
+    std::string carry;   // the incomplete record at the end of the last chunk
+    uint64_t seen;       // the records seen
+    int64_t  stampKept;  // when the last record was kept
+    uint32_t rand;       // the xorshift state of the random sampling
+
+    // the transform plugin
+    void *xfState;       // the instance of the plugin
+    bool  xfFailed;      // the plugin has failed, the data is dropped since then
+    std::string xfCarry; // the incomplete line at the end of the last chunk, if record-aware
+
+    // the coalescing of small writes
+    std::string coalesced;    // the data held for fdDest
+    int64_t stampCoalesceDue; // when the data held has to be flushed, 0 if none held
+  } HopStub;
+
+  typedef std::pair<int, int> FDPair;
+  typedef std::map<FDPair, HopStub> HopIndex;
+  HopIndex _hops;
+  FDSet    _fanInDests; // destinations that have complete records queued
+  std::map<int, size_t> _fanInRR; // the DRR round-robin cursor per destination
+
+  HopStub* hopOf(int fdSrc, int fdDest);
+  bool    queueToHop(HopStub* hop, const char* buf, int len);
+  void    dropHop(int fdSrc, int fdDest);
+  void    stageHop(HopStub& hop, const char* buf, int len);
+  void    transformChunk(HopStub& hop, const char* buf, int len);
+  void    runTransform(HopStub& hop, const char* in, int len, std::string& out);
+  void    passToHop(HopStub& hop, const char* buf, int len);
+  void    pendRecords(HopStub& hop, const char* buf, int len);
+  void    coalesceToHop(HopStub& hop, const char* buf, int len);
+  void    flushCoalesced(HopStub& hop);
+  void    flushCoalescedDue(int64_t stampNow);
+  std::set<FDPair> _coalescing; // the hops that hold data to flush
+  void    selectLines(HopStub& hop, const char* buf, int len);
+  bool    keepLine(HopStub& hop, const char* line, int len, int64_t stampNow);
+  std::string _hopOut, _xfOut; // the scratch of the lines kept from a chunk, and of the transformed
+  void    drainSrcFd(int fd, int childIdx);
+  void    emitToDest(int fdDest, const char* buf, int len, int childIdx);
+  void    drainFanIns();
+  void    flushHopsFrom(int fdSrc);
+
+  // the forwarding path doesn't walk _fd2fwd but a routing table compiled from
+  // it: dense and indexed by the source fd, where a Route keeps its destinations
+  // inline and spills to RouteTable::spill only if it has many
+  typedef struct _Route
+  {
+    int16_t ndests;  // -1 if the fd is not a source
+    int16_t reads;   // reads to take from the source per round
+    int     spill;   // offset in RouteTable::spill when ndests > ROUTE_INLINE_DESTS
+    int     hops;    // offset in RouteTable::hops of the per-destination hops, -1 if none has options
+    int8_t  prio;    // the highest priority class among the links of the source
+    int8_t  reserved[3];
+    int     dests[ROUTE_INLINE_DESTS];
+  } __attribute__((aligned(64))) Route;
+
+  typedef struct _RouteTable
+  {
+    std::vector<Route>     routes;
+    std::vector<int>       spill;
+    std::vector<HopStub *> hops;
+  } RouteTable;
+
+  typedef struct _RouteView
+  {
+    int ndests, reads, prio;
+    const int *dests;
+    HopStub *const *hops; // NULL if none of the destinations has options
+  } RouteView;
+
+  // the tables are double-buffered: compileRoutes() fills the one not in use then
+  // bumps _routeGen, so a reader holding the current generation is never torn
+  RouteTable _routeTables[2];
+  std::atomic<uint32_t> _routeGen;
+  bool _routesDirty;
+
+  void    compileRoutes();
+  bool    routeOf(int fdSrc, RouteView& view);
+  void    forwardChunk(const RouteView& route, const char* buf, int len, int childIdx);
+  int     prioOf(int fdSrc);
+
+  std::vector<int64_t> _fdWaitSince; // since when a ready source has been deferred, indexed by fd
+  unsigned schedulePriorities();
+  void    admitReady(int fd, int top, int64_t stampNow, unsigned& prios);
+
+#define FDF_TAP    (1 << 0)
+#define FDF_SOURCE (1 << 1) // the stdout handle of an in-process endpoint
+#define FDF_SINK   (1 << 2) // the stdin handle of an in-process endpoint
+#define FDF_IDLE   (1 << 3) // the source endpoint had no data at its last call
+  std::vector<uint8_t> _fdFlags; // per-fd attributes of the destinations, indexed by fd
+  void    setFdFlags(int fd, uint8_t flags);
+
+  // the throughput of an fd in the current period, by which the capacity of its pipe and
+  // the size to read it by adapt
+  typedef struct _FlowStub
+  {
+    int64_t bytes;  // read from or written to the fd in the period
+    int pipeSize;   // the capacity of the pipe, 0 if the fd is not a pipe that xtee resizes
+    int readSize;   // the size to read the fd by as a source
+    int64_t total;  // the bytes since the fd was linked
+  } FlowStub;
+  std::vector<FlowStub> _fdFlows; // indexed by fd
+  FlowStub  _flowNone; // handed out for an fd < 0, which has no flow to keep
+  int64_t   _stampAdapted;
+  FlowStub& flowOf(int fd);
+  void      trackPipe(int fd);
+  void      adaptPipes(int64_t stampNow);
+
+  // an endpoint is linked by a reserved fd per side, which is never read or written but
+  // keeps the number unique among the fds of the links
+  typedef std::map<int, Endpoint *> Endpoints; // by the cmdNo
+  Endpoints _endpoints;
+  std::vector<Endpoint *> _builtins; // the built-in endpoints that xtee owns
+  std::vector<Endpoint *> _fdEndpoints; // indexed by the reserved fd
+  int       reserveFd(Endpoint* endpoint, uint8_t flags);
+  Endpoint* endpointOf(int fd);
+  int       readFrom(int fd, char* buf, int size);
+  void      releaseFd(int fd);
+
+  bool    link(int fdIn, int fdTo, const LinkOpts* opts = NULL);
   void    unlink(int fdIn, int fdTo);
   std::string closeSrcFd(int& fdSrc);
   std::string closeDestFd(int& fdDest);
@@ -88,14 +358,65 @@ protected:
   //@return bytes read from the fd, -1 if error occured at reading
   int     checkAndForward(int &fd, int defaultfd, int childIdx = -1);
   void    closePipesToChild(ChildStub &child);
+  void    closeStdin();
+  bool    reapChild(ChildStub &child);
   int     stdinQoS(const char* buf, int len);
+  int     forwardTo(int fdDest, const char* buf, int len);
+
+  int     lookupSrcFd(int childId, int childFd);
+  bool    parseLink(char* link, LinkSpec& spec);
+  bool    parseLinkOpts(char* opts, LinkOpts& linkOpts);
+  bool    loadTransform(char* value, LinkOpts& linkOpts);
+  static void initLinkOpts(LinkOpts& linkOpts);
+  static void freeLinkOpts(LinkOpts& linkOpts);
+  static bool selectsLines(const LinkOpts& linkOpts);
+  void    wireLinks();
+  int     wireEndOf(int childId, int childFd);
+  void    acceptTaps();
+  void    readTapRequest(int fd);
+  void    closeGoneTaps();
+
+  // the CPU and NUMA placement of a party, applied to a child right after fork
+  typedef struct _Placement
+  {
+    cpu_set_t cpus;
+    int node; // the NUMA node to allocate memory from, -1 if not bound to a node
+  } Placement;
+
+  typedef std::map<int, Placement> Placements; // by the cmdNo, 0 refers to xtee itself
+  Placements _placements;
+
+  void    planPlacements();
+  bool    applyPlacement(int cmdNo);
+
+  // a run of the -c template over a chunk of stdin, in the chunked mode of -C
+  typedef struct _ChunkJob
+  {
+    int  idx;
+    int  pid;
+    int  pidfd;
+    int  fdIn, fdOut;  // fdOut is -1 if the output goes to a file
+    int  status;
+    bool exited, outEOF;
+    int64_t bytesIn, bytesOut;
+    int64_t lines;     // of the chunk so far, if it is cut by the lines
+    std::string feed;  // the data of the chunk yet to write to the stdin of the run
+    bool fedUp;        // the chunk has completed, its stdin closes once the feed is written
+    std::string out;   // the output held till the chunks ahead of it are gathered
+  } ChunkJob;
+
+  int     runChunks();
+  bool    spawnChunk(ChunkJob& job);
+  size_t  cutChunk(ChunkJob& job, const char* data, size_t len, bool& complete);
+  void    feedChunk(ChunkJob& job);
 
   bool _bQuit = false;
+  bool _bStdinEOF = false;
   typedef std::vector<char *> Strings;
-  Strings _childCommands, _fdLinks;
+  Strings _childCommands, _fdLinks, _placementSpecs;
 
 private:
-  static std::string _unlink(int fdBy, Xtee::FDIndex &lookup, Xtee::FDIndex &reverseLookup);
+  std::string _unlink(int fdBy, Xtee::FDIndex &lookup, Xtee::FDIndex &reverseLookup, bool bySrc);
 
   fd_set _fdsetRead, _fdsetErr;
 
@@ -104,6 +425,34 @@ private:
   int _kBpsLimit, _lastv;
   int _childsToStdin;
 
+  // the deadlines that the loop has to wake up for. The timerfd is armed to the
+  // earliest of them, so select() blocks indefinitely when nothing is due
+  enum
+  {
+    TIMER_IDLE = 0,  // -q, no more data read for the given seconds
+    TIMER_DURATION,  // -d, counted since the start of stdin as -t defines
+    TIMER_RATE,      // -s, the feeds of stdin resume after yielding to the rate limit
+    TIMER_POLL,      // the children that have no pidfd to watch
+    TIMER_COALESCE,  // the earliest of the hops holding small writes is due
+    TIMER_ADAPT,     // the pipes and the reads are resized by the throughput of the period
+    TIMER_PROFILE,   // -P, the resource usage of the children is sampled
+    TIMER_MAX
+  };
+
+  int64_t _deadlines[TIMER_MAX]; // the stamps due, 0 if not scheduled
+  int64_t _stampArmed;           // the stamp that the timerfd is armed to
+  int64_t _stampActivity;        // the last time any data was read
+  int64_t _stampStdinResume;     // the feeds of stdin are paused until then, 0 if not paused
+  int     _fdTimer;
+  int64_t _stampProfileStart;    // the timeline of profiling is relative to
+
+  void     setTimer(int timer, int64_t stampDue);
+  void     armTimer();
+  unsigned onTimers();
+
+  bool     sampleChild(ChildStub& child, ProcSample& sample);
+  void     profileChildren(int64_t stampNow);
+
 public:
   Options _options;
 };
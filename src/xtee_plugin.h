@@ -0,0 +1,62 @@
+#ifndef __XTEE_PLUGIN_H__
+#define __XTEE_PLUGIN_H__
+
+// the C ABI of the transform plugins that a link loads by the option xf=<path.so>[:<arg>].
+// A plugin exports xtee_transform() that returns its descriptor, then xtee calls process()
+// with the data of the link after reading it and before forwarding it to the target, such as:
+//
+//   static int upper(void *state, const char *in, size_t len, xtee_emit_t emit, void *ctx)
+//   {
+//     char out[4096];
+//     for (size_t i = 0; i < len; i += sizeof(out))
+//     {
+//       size_t n = (len - i < sizeof(out)) ? (len - i) : sizeof(out);
+//       for (size_t j = 0; j < n; j++)
+//         out[j] = toupper(in[i + j]);
+//       emit(ctx, out, n);
+//     }
+//     return 0;
+//   }
+//
+//   static const xtee_transform_t xf = {XTEE_PLUGIN_ABI, XTEE_XF_STATELESS, NULL, upper, NULL};
+//   const xtee_transform_t *xtee_transform(void) { return &xf; }
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define XTEE_PLUGIN_ABI       (1)
+#define XTEE_TRANSFORM_SYMBOL "xtee_transform"
+
+#define XTEE_XF_RECORDS   (1 << 0) // record-aware, process() is given whole lines only
+#define XTEE_XF_STATELESS (1 << 1) // keeps no state between the calls, so one instance serves all the links
+
+// passes a piece of the output on, which is copied before emit() returns
+typedef void (*xtee_emit_t)(void *ctx, const char *data, size_t len);
+
+typedef struct _xtee_transform
+{
+  int      abi;   // XTEE_PLUGIN_ABI that the plugin is built with
+  unsigned flags; // XTEE_XF_XXX
+
+  // creates the state of an instance from the <arg> of the option, may be NULL
+  void *(*open)(const char *arg);
+
+  // transforms a chunk of input into the output given thru emit()
+  //@return 0 if succeeded, otherwise the link drops its data from then on
+  int (*process)(void *state, const char *in, size_t len, xtee_emit_t emit, void *ctx);
+
+  // destroys the state of an instance, may be NULL
+  void (*close)(void *state);
+} xtee_transform_t;
+
+typedef const xtee_transform_t *(*xtee_transform_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __XTEE_PLUGIN_H__